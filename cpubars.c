@@ -1,13 +1,22 @@
 // -*- c-file-style: "bsd" -*-
 
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <langinfo.h>
 #include <limits.h>
 #include <locale.h>
+#include <netdb.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -16,6 +25,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
@@ -27,6 +37,15 @@
 #include <sys/sysctl.h>
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
 /******************************************************************
  * Utilities
  */
@@ -79,6 +98,11 @@ epanic(const char *fmt, ...)
         exit(-1);
 }
 
+// The number of system calls made while sampling and drawing, for the
+// overhead overlay.  Only the calls made every tick are counted, and
+// with -T, only those of the display thread.
+__thread unsigned long sys_calls;
+
 ssize_t
 readn_str(int fd, char *buf, size_t count)
 {
@@ -86,6 +110,7 @@ readn_str(int fd, char *buf, size_t count)
         off_t pos = 0;
         while (1) {
                 ssize_t r = read(fd, buf + pos, count - pos);
+                sys_calls++;
                 if (r < 0)
                         return r;
                 else if (r == 0)
@@ -140,40 +165,510 @@ cpuset_max(const char *cpuset)
         return max;
 }
 
+// Return the number of CPU's in cpuset, such as "0-3,8".
+int
+cpuset_count(const char *cpuset)
+{
+        int count = 0;
+        const char *p = cpuset;
+        while (*p) {
+                if (isspace(*p) || *p == ',') {
+                        ++p;
+                        continue;
+                }
+                char *end;
+                long lo = strtol(p, &end, 10), hi = lo;
+                if (end == p)
+                        panic("invalid cpu set: %s", cpuset);
+                if (*end == '-') {
+                        p = end + 1;
+                        hi = strtol(p, &end, 10);
+                        if (end == p || hi < lo)
+                                panic("invalid cpu set: %s", cpuset);
+                }
+                count += hi - lo + 1;
+                p = end;
+        }
+        return count;
+}
+
+// Return the time in microseconds from a monotonic clock.  This is
+// only meaningful relative to other calls, but isn't thrown off by
+// the wall clock being stepped.
 uint64_t
 time_usec(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Return the wall-clock time in microseconds since the epoch.
+uint64_t
+time_wall_usec(void)
 {
         struct timeval tv;
         gettimeofday(&tv, 0);
         return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+// A fixed-period schedule.  Ticks fall on absolute deadlines, so the
+// time spent working between ticks (or waking up early for input)
+// doesn't make the period drift.
+struct tick
+{
+        uint64_t next, period;
+};
+
+void
+tick_init(struct tick *t, uint64_t period)
+{
+        t->period = period;
+        t->next = time_usec() + period;
+}
+
+// Return the number of milliseconds until the next tick is due, or 0
+// if it is already due.
+int
+tick_timeout(const struct tick *t)
+{
+        uint64_t now = time_usec();
+        if (now >= t->next)
+                return 0;
+        return (t->next - now + 999) / 1000;
+}
+
+// Move on to the next tick.  If we've fallen behind by more than a
+// period, skip the missed ticks rather than firing them back to back.
+void
+tick_advance(struct tick *t)
+{
+        t->next += t->period;
+        uint64_t now = time_usec();
+        if (t->next < now && t->period)
+                t->next += (now - t->next) / t->period * t->period;
+}
+
+
+/******************************************************************
+ * Batched reads
+ */
+
+// Every file we read each tick is registered here, and batch_read
+// reads all of them at once at offset 0.  procfs files produce their
+// whole contents in a single read if the buffer is big enough, so
+// there's no need to read to EOF or seek back, and with io_uring the
+// whole batch costs a single system call no matter how many files
+// the sources add.
+
+#define BATCH_MAX 16
+
+static struct batch_file
+{
+        int fd;
+        char *buf;
+        size_t size;
+        // If set, a buffer that comes back full is doubled and
+        // re-read; otherwise the contents are silently truncated.
+        bool grow;
+        // The result of the last read, or -1 with errno in err
+        ssize_t len;
+        int err;
+        // Set by batch_read and cleared by batch_get
+        bool fresh;
+} batch_files[BATCH_MAX];
+static int batch_nfiles;
+
+// Register fd to be read in each batch into a buffer of size bytes.
+// Returns the handle to pass to batch_get.
+int
+batch_add(int fd, size_t size, bool grow)
+{
+        if (batch_nfiles == BATCH_MAX)
+                panic("too many batched files");
+        struct batch_file *f = &batch_files[batch_nfiles];
+        f->fd = fd;
+        f->size = size;
+        f->grow = grow;
+        if (!(f->buf = malloc(size)))
+                epanic("allocating file buffer");
+        return batch_nfiles++;
+}
+
+static void
+batch_pread(struct batch_file *f)
+{
+        sys_calls++;
+        f->len = pread(f->fd, f->buf, f->size - 1, 0);
+        f->err = errno;
+}
+
+#ifdef HAVE_IO_URING
+// A raw io_uring, so we don't need liburing.  batch_uring_fd is 0
+// until the first batch, and -1 if io_uring is unavailable, in which
+// case we fall back to one pread per file.
+static int batch_uring_fd;
+static unsigned *batch_sq_tail, *batch_sq_mask, *batch_sq_array;
+static unsigned *batch_cq_head, *batch_cq_tail, *batch_cq_mask;
+static struct io_uring_sqe *batch_sqes;
+static struct io_uring_cqe *batch_cqes;
+
+static bool
+batch_uring_init(void)
+{
+        struct io_uring_params p;
+        memset(&p, 0, sizeof p);
+        int fd = syscall(__NR_io_uring_setup, BATCH_MAX, &p);
+        if (fd < 0)
+                return false;
+
+        size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        size_t cq_size = p.cq_off.cqes +
+                p.cq_entries * sizeof(struct io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+                sq_size = cq_size = MAX(sq_size, cq_size);
+        char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        char *cq = sq;
+        if (sq != MAP_FAILED && !single)
+                cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void *sqes = MAP_FAILED;
+        if (cq != MAP_FAILED)
+                sqes = mmap(NULL, p.sq_entries * sizeof *batch_sqes,
+                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+                // Closing the ring releases any mappings we got
+                close(fd);
+                return false;
+        }
+
+        batch_uring_fd = fd;
+        batch_sq_tail = (unsigned*)(sq + p.sq_off.tail);
+        batch_sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+        batch_sq_array = (unsigned*)(sq + p.sq_off.array);
+        batch_cq_head = (unsigned*)(cq + p.cq_off.head);
+        batch_cq_tail = (unsigned*)(cq + p.cq_off.tail);
+        batch_cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+        batch_sqes = sqes;
+        batch_cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+        return true;
+}
+
+// Submit a read of every file and wait for them all.  Returns false
+// if the io_uring can't do the job, leaving the caller to fall back.
+static bool
+batch_uring_read(void)
+{
+        if (batch_uring_fd == 0 && !batch_uring_init())
+                batch_uring_fd = -1;
+        if (batch_uring_fd < 0)
+                return false;
+
+        unsigned tail = *batch_sq_tail;
+        int i;
+        for (i = 0; i < batch_nfiles; i++, tail++) {
+                struct batch_file *f = &batch_files[i];
+                unsigned idx = tail & *batch_sq_mask;
+                struct io_uring_sqe *sqe = &batch_sqes[idx];
+                memset(sqe, 0, sizeof *sqe);
+                sqe->opcode = IORING_OP_READ;
+                sqe->fd = f->fd;
+                sqe->addr = (uintptr_t)f->buf;
+                sqe->len = f->size - 1;
+                sqe->off = 0;
+                sqe->user_data = i;
+                batch_sq_array[idx] = idx;
+        }
+        __atomic_store_n(batch_sq_tail, tail, __ATOMIC_RELEASE);
+
+        int submit = batch_nfiles, left = batch_nfiles;
+        bool unsupported = false;
+        while (left) {
+                sys_calls++;
+                int r = syscall(__NR_io_uring_enter, batch_uring_fd,
+                                submit, left, IORING_ENTER_GETEVENTS,
+                                NULL, 0);
+                if (r < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        epanic("io_uring_enter");
+                }
+                submit -= r;
+
+                unsigned head = *batch_cq_head;
+                unsigned ctail = __atomic_load_n(batch_cq_tail,
+                                                 __ATOMIC_ACQUIRE);
+                for (; head != ctail; head++, left--) {
+                        struct io_uring_cqe *cqe =
+                                &batch_cqes[head & *batch_cq_mask];
+                        struct batch_file *f = &batch_files[cqe->user_data];
+                        f->len = cqe->res < 0 ? -1 : cqe->res;
+                        f->err = -cqe->res;
+                        // Kernels before 5.6 don't have IORING_OP_READ
+                        if (cqe->res == -EINVAL)
+                                unsupported = true;
+                }
+                __atomic_store_n(batch_cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        if (unsupported) {
+                close(batch_uring_fd);
+                batch_uring_fd = -1;
+                return false;
+        }
+        return true;
+}
+#endif // HAVE_IO_URING
+
+// Read every registered file.
+void
+batch_read(void)
+{
+        int i;
+#ifdef HAVE_IO_URING
+        if (!batch_uring_read())
+#endif
+                for (i = 0; i < batch_nfiles; i++)
+                        batch_pread(&batch_files[i]);
+        for (i = 0; i < batch_nfiles; i++)
+                batch_files[i].fresh = true;
+}
+
+// Return the NUL-terminated contents of batched file h, or NULL with
+// errno set on failure.  If h wasn't read by a batch_read since the
+// last call, it's read on its own.  If len is non-NULL, it receives
+// the length of the contents.
+char *
+batch_get(int h, size_t *len)
+{
+        struct batch_file *f = &batch_files[h];
+        if (!f->fresh)
+                batch_pread(f);
+        f->fresh = false;
+        while (f->grow && f->len == f->size - 1) {
+                // The buffer was too small
+                f->size *= 2;
+                free(f->buf);
+                if (!(f->buf = malloc(f->size)))
+                        epanic("allocating file buffer");
+                batch_pread(f);
+        }
+        if (f->len < 0) {
+                errno = f->err;
+                return NULL;
+        }
+        f->buf[f->len] = 0;
+        if (len)
+                *len = f->len;
+        return f->buf;
+}
+
+
+/******************************************************************
+ * Output buffer
+ */
+
+// All terminal output for a frame is collected in out_buf and sent
+// with a single write by out_flush, so a frame never reaches the
+// terminal (or an SSH connection) in pieces.
+static char *out_buf;
+static size_t out_len, out_cap;
+// Where out_flush sends output.  If out_sink is set, it gets the
+// output instead of out_fd.
+static int out_fd = 1;
+static void (*out_sink)(const char *buf, size_t len);
+// The size of the last frame sent by out_flush, and running totals
+static size_t out_frame_bytes;
+static unsigned long long out_total_bytes, out_frames;
+
+static void
+out_grow(size_t len)
+{
+        size_t cap = out_cap ? out_cap : 4096;
+        while (cap < out_len + len)
+                cap *= 2;
+        char *nbuf = realloc(out_buf, cap);
+        if (!nbuf)
+                epanic("allocating output buffer");
+        out_buf = nbuf;
+        out_cap = cap;
+}
+
+// Make room for len more bytes at out_buf + out_len, for callers that
+// write there directly.
+static inline void
+out_reserve(size_t len)
+{
+        if (out_len + len > out_cap)
+                out_grow(len);
+}
+
+static void
+out_write(const char *buf, size_t len)
+{
+        out_reserve(len);
+        memcpy(out_buf + out_len, buf, len);
+        out_len += len;
+}
+
+static void
+out_puts(const char *str)
+{
+        out_write(str, strlen(str));
+}
+
+static int
+out_putc(int ch)
+{
+        char c = ch;
+        out_write(&c, 1);
+        return ch;
+}
+
+// Output n in decimal.
+static void
+out_put_uint(unsigned long long n)
+{
+        char buf[20], *p = buf + sizeof buf;
+        do {
+                *--p = '0' + n % 10;
+                n /= 10;
+        } while (n);
+        out_write(p, buf + sizeof buf - p);
+}
+
+// Output n / 10^digits in decimal, with exactly digits (at least 1)
+// decimal places.
+static void
+out_put_fixed(unsigned long long n, int digits)
+{
+        char buf[32], *p = buf + sizeof buf;
+        while (digits--) {
+                *--p = '0' + n % 10;
+                n /= 10;
+        }
+        *--p = '.';
+        do {
+                *--p = '0' + n % 10;
+                n /= 10;
+        } while (n);
+        out_write(p, buf + sizeof buf - p);
+}
+
+// Output a terminfo string.  Only strings with padding need to go
+// through tputs.
+static void
+out_putp(const char *str)
+{
+        if (!str)
+                return;
+        if (strchr(str, '$'))
+                tputs(str, 1, out_putc);
+        else
+                out_puts(str);
+}
+
+// Send everything output since the last out_flush.
+void
+out_flush(void)
+{
+        size_t pos = 0;
+        if (out_sink) {
+                out_sink(out_buf, out_len);
+                pos = out_len;
+        }
+        while (pos < out_len) {
+                ssize_t r = write(out_fd, out_buf + pos, out_len - pos);
+                sys_calls++;
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r < 0) {
+                        out_len = 0;
+                        epanic("failed to write output");
+                }
+                pos += r;
+        }
+        out_frame_bytes = out_len;
+        out_total_bytes += out_len;
+        out_frames++;
+        out_len = 0;
+}
+
 
 /******************************************************************
  * Stat parser
  */
 
+// The counters we keep for each CPU.  This only names them; struct
+// cpustats stores them by field, indexed by CPUSTAT_FIELD.
 struct cpustat
 {
-        bool online;
         unsigned long long user, nice, sys, iowait, irq, softirq;
+        unsigned long long steal, guest, guest_nice;
 };
+#define CPUSTAT_FIELD(name) \
+        (offsetof(struct cpustat, name) / sizeof(unsigned long long))
+#define NFIELDS (sizeof(struct cpustat) / sizeof(unsigned long long))
 
+// The columns of a "cpu" line in /proc/stat, in order, as fields.
+// Columns we don't keep are -1.
+static const int cpustats_columns[] = {
+#define COL(name) CPUSTAT_FIELD(name)
+        COL(user), COL(nice), COL(sys), -1 /* idle */, COL(iowait),
+        COL(irq), COL(softirq), COL(steal), COL(guest), COL(guest_nice)
+#undef COL
+};
+#define NCOLUMNS (sizeof(cpustats_columns)/sizeof(cpustats_columns[0]))
+
+// A snapshot or delta of the statistics of every CPU.  The counters
+// are stored as one array per field, so passes over a field of every
+// CPU walk contiguous memory.  Element -1 of each array is the
+// aggregate line, which is also how the rest of the code refers to
+// it.  The online CPU's are a bitmap; the counters of offline CPU's
+// are left over from whenever they were last online.
 struct cpustats
 {
+        // The number of CPU's this has entries for, which is
+        // cpustats_cpus except for the remote hosts main_client shows
+        int cpus;
         int online, max;
         unsigned long long real;
-        struct cpustat avg;
-        struct cpustat *cpus;
+        unsigned long long *field[NFIELDS];
+        uint64_t *online_map;
+        // In aggregated views, the number of online CPU's summed into
+        // the aggregate line and into each CPU entry.  weight is NULL
+        // if each entry is a single CPU.
+        int avg_weight, *weight;
+        // If nonzero, how much CPU time the aggregate line can
+        // account for, in thousandths of a CPU, in place of one CPU
+        // per online CPU.  The cgroup source sets this to the
+        // cgroup's quota.
+        int avg_capacity;
+        // If not NULL, each entry's highest and 95th percentile busy
+        // fraction over the samples this delta was put together from
+        // (see -u), from 0 to CPUSTATS_PEAK_SCALE - 1.  Like the
+        // fields, these have room for the aggregate line at -1.
+        const uint8_t *peak, *p95;
 };
+#define CPUSTAT(st, name, cpu) ((st)->field[CPUSTAT_FIELD(name)][cpu])
+#define CPUSTATS_PEAK_SCALE 64
 
-// File descriptors for /proc/stat and /proc/loadavg
+// File descriptors for /proc/stat and /proc/loadavg, and their
+// batch handles
 static int cpustats_fd, cpustats_load_fd;
-// Maximum number of CPU's this system supports
-static int cpustats_cpus;
-// A buffer large enough to read cpustats_cpus worth of /proc/stat
-static char *cpustats_buf;
-static int cpustats_buf_size;
+static int cpustats_batch, cpustats_load_batch;
+// The same for /proc/pressure/cpu, which may not exist.  The fd is -1
+// if it doesn't, and it only joins the batch once someone asks.
+static int cpustats_pressure_fd = -1, cpustats_pressure_batch = -1;
+// Maximum number of CPU's this system supports, and the number of
+// words in an online bitmap
+static int cpustats_cpus, cpustats_words;
+#define CPUSTATS_WORDS(cpus) (((cpus) + 63) / 64)
+// Clock ticks per second, the unit of all cpustat fields
+static long cpustats_clk_tck;
 
 static const char *proc_path = NULL;
 
@@ -185,11 +680,18 @@ cpustats_findproc(void)
         const char *cand_proc_paths[NUM_CAND_PROC_PATHS] =
                 { "/proc",
                   "/compat/linux/proc" };
+        int ncand = NUM_CAND_PROC_PATHS;
+        // A proc_path set beforehand is the only candidate
+        if (proc_path) {
+                cand_proc_paths[0] = proc_path;
+                ncand = 1;
+                proc_path = NULL;
+        }
 
         // Look for a "stat" file as an indicator that we have a Linuxy procfs
         // available as opposed to some other procfs that has no "stat" file.
         int i;
-        for (i=0; i<NUM_CAND_PROC_PATHS; i++) {
+        for (i=0; i<ncand; i++) {
                 int proc_fd;
                 if ((proc_fd = open(cand_proc_paths[i], O_RDONLY)) < 0)
                         continue;
@@ -202,6 +704,7 @@ cpustats_findproc(void)
                         close(cpustats_fd);
                         continue;
                 }
+                cpustats_pressure_fd = openat(proc_fd, "pressure/cpu", O_RDONLY);
                 close(proc_fd);
                 proc_path = cand_proc_paths[i];
         }
@@ -209,106 +712,300 @@ cpustats_findproc(void)
         if (proc_path == NULL) {
                 fprintf(stderr, "checked procfs candidates:\n");
                 int i;
-                for (i=0; i<NUM_CAND_PROC_PATHS; i++)
+                for (i=0; i<ncand; i++)
                         fprintf(stderr, "\t%s\n", cand_proc_paths[i]);
                 panic("failed to locate a suitable procfs with stat/loadavg");
         }
 }
 
-void
-cpustats_init(void)
+// Parse a space-separated unsigned decimal number at *pos and advance
+// *pos past it.  Returns false if there is no number at *pos.  We do
+// this by hand because sscanf is most of cpubars' user time on large
+// systems.
+static bool
+parse_ull(char **pos, unsigned long long *out)
 {
-        cpustats_findproc();
-
-        // Find the maximum number of CPU's we'll need
-#ifdef __FreeBSD__
-        size_t oldlenp = sizeof(cpustats_cpus);
-        if (sysctlbyname("kern.smp.maxcpus", &cpustats_cpus, &oldlenp, NULL, 0))
-                epanic("failed to read kern.smp.maxcpus sysctl");
-#else
-        char *poss = read_all("/sys/devices/system/cpu/possible");
-        cpustats_cpus = cpuset_max(poss) + 1;
-        free(poss);
-#endif //__FreeBSD__
+        char *p = *pos;
+        while (*p == ' ')
+                p++;
+        if (*p < '0' || *p > '9')
+                return false;
+        unsigned long long val = 0;
+        for (; *p >= '0' && *p <= '9'; p++)
+                val = val * 10 + (*p - '0');
+        *out = val;
+        *pos = p;
+        return true;
+}
 
-        // Allocate a big buffer to read /proc/stat in to
-        cpustats_buf_size = cpustats_cpus * 128;
-        if (!(cpustats_buf = malloc(cpustats_buf_size)))
-                epanic("allocating cpustats file buffer");
+// Like parse_ull, but parse a number with an optional fractional
+// part, such as a load average.
+static bool
+parse_float(char **pos, float *out)
+{
+        unsigned long long ip, fp = 0, div = 1;
+        if (!parse_ull(pos, &ip))
+                return false;
+        char *p = *pos;
+        if (*p == '.')
+                for (p++; *p >= '0' && *p <= '9'; p++) {
+                        if (div < 1000000) {
+                                fp = fp * 10 + (*p - '0');
+                                div *= 10;
+                        }
+                }
+        *out = ip + (float)fp / div;
+        *pos = p;
+        return true;
 }
 
-void
+// Read the load averages into load.  Returns the number of runnable
+// tasks, which makes this a cheap probe for sudden changes in load.
+int
 cpustats_loadavg(float load[3])
 {
-        if ((readn_str(cpustats_load_fd, cpustats_buf, cpustats_buf_size)) < 0)
+#ifdef __FreeBSD__
+        if (cpustats_load_batch < 0) {
+                // Without a procfs, take the load average from the
+                // vm.loadavg sysctl.  There's no cheap count of
+                // runnable threads, so that's 0.
+                double avg[3];
+                if (getloadavg(avg, 3) < 3)
+                        epanic("failed to get the load average");
+                sys_calls++;
+                int i;
+                for (i = 0; i < 3; i++)
+                        load[i] = avg[i];
+                return 0;
+        }
+#endif
+        char *pos = batch_get(cpustats_load_batch, NULL);
+        if (!pos)
                 epanic("failed to read %s/loadavg", proc_path);
-        if (sscanf(cpustats_buf, "%f %f %f",
-                   &load[0], &load[1], &load[2]) != 3)
+        if (!parse_float(&pos, &load[0]) || !parse_float(&pos, &load[1]) ||
+            !parse_float(&pos, &load[2]))
                 epanic("failed to parse %s/loadavg", proc_path);
-        if ((lseek(cpustats_load_fd, 0, SEEK_SET)) < 0)
-                epanic("failed to seek %s/loadavg", proc_path);
+        // The next field is the number of runnable tasks
+        unsigned long long runnable = 0;
+        parse_ull(&pos, &runnable);
+        return runnable;
+}
+
+// Read the percentages of time some and all runnable tasks were
+// stalled waiting for a CPU, averaged over 10, 60, and 300 seconds.
+// Returns false if the kernel doesn't track pressure.  full is all -1
+// if the kernel only reports some.
+bool
+cpustats_pressure(float some[3], float full[3])
+{
+        if (cpustats_pressure_fd < 0)
+                return false;
+        if (cpustats_pressure_batch < 0) {
+                // PSI can be built in but disabled at boot, in which
+                // case the file exists but can't be read
+                char c;
+                if (pread(cpustats_pressure_fd, &c, 1, 0) < 0) {
+                        close(cpustats_pressure_fd);
+                        cpustats_pressure_fd = -1;
+                        return false;
+                }
+                cpustats_pressure_batch =
+                        batch_add(cpustats_pressure_fd, 256, false);
+        }
+        char *pos = batch_get(cpustats_pressure_batch, NULL);
+        if (!pos)
+                epanic("failed to read %s/pressure/cpu", proc_path);
+
+        // Lines look like "some avg10=1.23 avg60=0.50 avg300=0.10
+        // total=12345"
+        int i;
+        for (i = 0; i < 3; i++)
+                some[i] = full[i] = -1;
+        while (*pos) {
+                float *out = NULL;
+                if (strncmp(pos, "some ", 5) == 0)
+                        out = some;
+                else if (strncmp(pos, "full ", 5) == 0)
+                        out = full;
+                for (i = 0; out && i < 3; i++) {
+                        while (*pos && *pos != '\n' && *pos != '=')
+                                pos++;
+                        if (*pos != '=')
+                                break;
+                        pos++;
+                        if (!parse_float(&pos, &out[i]))
+                                break;
+                }
+                while (*pos && *pos != '\n')
+                        pos++;
+                if (*pos) pos++;
+        }
+        return some[0] >= 0;
 }
 
+static bool
+cpustats_online(const struct cpustats *st, int cpu)
+{
+        return (st->online_map[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+static void
+cpustats_set_online(struct cpustats *st, int cpu)
+{
+        st->online_map[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+}
+
+// Return the first online CPU at or after cpu, or -1 if there are
+// none.
+static int
+cpustats_next(const struct cpustats *st, int cpu)
+{
+        int word = cpu / 64, words = CPUSTATS_WORDS(st->cpus);
+        if (word >= words)
+                return -1;
+        uint64_t bits = st->online_map[word] & (~(uint64_t)0 << (cpu % 64));
+        while (!bits) {
+                if (++word >= words)
+                        return -1;
+                bits = st->online_map[word];
+        }
+        return word * 64 + __builtin_ctzll(bits);
+}
+#define FOR_EACH_ONLINE(cpu, st)                                        \
+        for (cpu = cpustats_next(st, 0); cpu >= 0;                      \
+             cpu = cpustats_next(st, cpu + 1))
+
+// Allocate a cpustats with entries for cpus CPU's.
 struct cpustats*
-cpustats_alloc(void)
+cpustats_alloc_cpus(int cpus)
 {
         struct cpustats *res = malloc(sizeof *res);
         if (!res)
                 epanic("allocating cpustats");
         memset(res, 0, sizeof *res);
-        res->cpus = malloc(cpustats_cpus * sizeof *res->cpus);
-        if (!res->cpus)
+        res->cpus = cpus;
+        // All of the fields come from one allocation, with room for
+        // the aggregate line before each
+        unsigned long long *block =
+                calloc(NFIELDS * (cpus + 1), sizeof *block);
+        res->online_map = calloc(CPUSTATS_WORDS(cpus),
+                                 sizeof *res->online_map);
+        if (!block || !res->online_map)
                 epanic("allocating per-CPU cputats");
-        memset(res->cpus, 0, cpustats_cpus * sizeof *res->cpus);
+        int field;
+        for (field = 0; field < NFIELDS; field++)
+                res->field[field] = block + field * (cpus + 1) + 1;
         return res;
 }
 
+// Allocate a cpustats for this system's CPU's.
+struct cpustats*
+cpustats_alloc(void)
+{
+        return cpustats_alloc_cpus(cpustats_cpus);
+}
+
 void
-cpustats_read(struct cpustats *out)
+cpustats_free(struct cpustats *st)
 {
-        // On kernels prior to 2.6.37, this can take a long time on
-        // large systems because updating IRQ counts is slow.  See
-        //   https://lkml.org/lkml/2010/9/29/259
+        if (!st)
+                return;
+        free(st->field[0] - 1);
+        free(st->online_map);
+        free(st->weight);
+        free(st);
+}
 
-        int i;
-        for (i = 0; i < cpustats_cpus; i++)
-                out->cpus[i].online = false;
+// Copy the set of online CPU's in `in' to `out', but not the
+// counters.  `out' may have room for more CPU's than `in' (but not
+// fewer online), in which case the rest are offline.
+void
+cpustats_copy_set(struct cpustats *out, const struct cpustats *in)
+{
+        int words = CPUSTATS_WORDS(MIN(out->cpus, in->cpus));
+        out->online = in->online;
+        out->max = in->max;
+        memcpy(out->online_map, in->online_map,
+               words * sizeof *out->online_map);
+        memset(out->online_map + words, 0,
+               (CPUSTATS_WORDS(out->cpus) - words) * sizeof *out->online_map);
+}
 
-        out->online = out->max = 0;
-        out->real = time_usec() * sysconf(_SC_CLK_TCK) / 1000000;
+// Copy `in' to `out', which must have the same number of CPU's.  This
+// doesn't copy weights or peaks.
+void
+cpustats_copy(struct cpustats *out, const struct cpustats *in)
+{
+        cpustats_copy_set(out, in);
+        out->real = in->real;
+        out->avg_capacity = in->avg_capacity;
+        memcpy(out->field[0] - 1, in->field[0] - 1,
+               NFIELDS * (out->cpus + 1) * sizeof *out->field[0]);
+}
 
-        if ((readn_str(cpustats_fd, cpustats_buf, cpustats_buf_size)) < 0)
-                epanic("failed to read %s/stat", proc_path);
+// Clear the counters of the aggregate line and every CPU, and mark
+// every CPU offline.
+void
+cpustats_clear(struct cpustats *st)
+{
+        memset(st->field[0] - 1, 0,
+               NFIELDS * (st->cpus + 1) * sizeof *st->field[0]);
+        memset(st->online_map, 0,
+               CPUSTATS_WORDS(st->cpus) * sizeof *st->online_map);
+        st->online = st->max = 0;
+}
 
-        char *pos = cpustats_buf;
-        while (strncmp(pos, "cpu", 3) == 0) {
+static void
+cpustats_init_stat(void)
+{
+        // A buffer large enough for cpustats_cpus worth of cpu lines.
+        // It's fine to cut off the "intr" line and everything after.
+        cpustats_batch = batch_add(cpustats_fd, cpustats_cpus * 128, false);
+}
+
+// Parse the cpu lines of /proc/stat contents pos into out.
+static void
+cpustats_parse_stat(struct cpustats *out, char *pos)
+{
+        while (pos[0] == 'c' && pos[1] == 'p' && pos[2] == 'u') {
                 pos += 3;
 
-                struct cpustat *st;
                 int cpu = -1;
                 if (*pos == ' ') {
                         // Aggregate line
-                        st = &out->avg;
-                } else if (isdigit(*pos)) {
-                        cpu = strtol(pos, &pos, 10);
-                        if (cpu >= cpustats_cpus)
+                } else if (*pos >= '0' && *pos <= '9') {
+                        unsigned long long n;
+                        parse_ull(&pos, &n);
+                        if (n >= cpustats_cpus)
                                 goto next;
-                        st = &out->cpus[cpu];
+                        cpu = n;
                 } else {
                         goto next;
                 }
 
                 // Earlier versions of Linux only reported user, nice,
-                // sys, and idle.
-                st->iowait = st->irq = st->softirq = 0;
-                unsigned long long toss;
-                if (sscanf(pos, " %llu %llu %llu %llu %llu %llu %llu",
-                           &st->user, &st->nice, &st->sys, &toss,
-                           &st->iowait, &st->irq, &st->softirq) < 4)
-                        continue;
-                st->online = true;
-                if (cpu != -1)
+                // sys, and idle, and later versions keep adding
+                // columns, so take as many as we understand and zero
+                // the rest.
+                int col;
+                unsigned long long val;
+                for (col = 0; col < NCOLUMNS && parse_ull(&pos, &val); col++)
+                        if (cpustats_columns[col] != -1)
+                                out->field[cpustats_columns[col]][cpu] = val;
+                if (col < 4)
+                        goto next;
+                for (; col < NCOLUMNS; col++)
+                        if (cpustats_columns[col] != -1)
+                                out->field[cpustats_columns[col]][cpu] = 0;
+                // Time spent running guests is also counted as user
+                // time.  We show guest as its own segment, so take it
+                // back out.  guest_nice stays in nice.
+                CPUSTAT(out, user, cpu) -= MIN(CPUSTAT(out, guest, cpu),
+                                               CPUSTAT(out, user, cpu));
+                if (cpu != -1) {
+                        cpustats_set_online(out, cpu);
                         out->online++;
+                }
                 if (cpu > out->max)
                         out->max = cpu;
 
@@ -318,637 +1015,5120 @@ cpustats_read(struct cpustats *out)
                         pos++;
                 if (*pos) pos++;
         }
-
-        if ((lseek(cpustats_fd, 0, SEEK_SET)) < 0)
-                epanic("failed to seek %s/stat", proc_path);
 }
 
+// Read per-CPU statistics from /proc/stat.
 static void
-cpustats_subtract1(struct cpustat *out,
-                   const struct cpustat *a, const struct cpustat *b)
+cpustats_read_stat(struct cpustats *out)
 {
-        out->online = a->online && b->online;
-        if (out->online) {
-#define SUB(field) out->field = a->field - b->field
-                SUB(user);
-                SUB(nice);
-                SUB(sys);
-                SUB(iowait);
-                SUB(irq);
-                SUB(softirq);
-#undef SUB
-        }
+        // On kernels prior to 2.6.37, this can take a long time on
+        // large systems because updating IRQ counts is slow.  See
+        //   https://lkml.org/lkml/2010/9/29/259
+        // Even on later kernels, the "intr" line costs time
+        // proportional to the number of IRQs times the number of
+        // CPUs.
+
+        char *pos = batch_get(cpustats_batch, NULL);
+        if (!pos)
+                epanic("failed to read %s/stat", proc_path);
+        cpustats_parse_stat(out, pos);
 }
 
-void
-cpustats_subtract(struct cpustats *out,
-                  const struct cpustats *a, const struct cpustats *b)
+// The cgroup source reads the CPU time of the cgroup at
+// cpustats_cgroup, either an absolute path or one relative to
+// /sys/fs/cgroup.  cgroup v2 only reports a cgroup's total user and
+// system time, so there are no per-CPU bars, just the average.
+// cgroup v1's cpuacct controller also reports it per CPU.  The
+// average is scaled to the cgroup's CPU quota, or without one, to
+// the CPU's it may run on.  Each file is opened once and joins the
+// read batch, like /proc/stat.
+const char *cpustats_cgroup;
+static char cpustats_cg_path[PATH_MAX];
+// Batch handles, or -1 for files this cgroup doesn't have
+static int cpustats_cg_stat = -1, cpustats_cg_user = -1, cpustats_cg_sys = -1;
+static int cpustats_cg_max = -1, cpustats_cg_quota = -1;
+static int cpustats_cg_period = -1, cpustats_cg_cpus = -1;
+// The host's online CPU's, which mask cgroup v1's per-CPU lists, as
+// read and as a bitmap like online_map
+static int cpustats_cg_online = -1;
+static uint64_t *cpustats_cg_online_map;
+
+static int
+cpustats_cg_open(const char *name, size_t size)
 {
-        out->online = out->max = 0;
-        out->real = a->real - b->real;
-        cpustats_subtract1(&out->avg, &a->avg, &b->avg);
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof path, "%s/%s", cpustats_cg_path,
+                     name) >= sizeof path)
+                panic("cgroup path too long");
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 && errno == ENOENT)
+                return -1;
+        if (fd < 0)
+                epanic("failed to open %s", path);
+        return batch_add(fd, size, true);
+}
 
-        int i;
-        for (i = 0; i < cpustats_cpus; i++) {
-                cpustats_subtract1(&out->cpus[i], &a->cpus[i], &b->cpus[i]);
-                if (out->cpus[i].online) {
-                        out->online++;
-                        out->max = i;
+static char *
+cpustats_cg_get(int h, const char *name)
+{
+        char *buf = batch_get(h, NULL);
+        if (!buf)
+                epanic("failed to read %s/%s", cpustats_cg_path, name);
+        return buf;
+}
+
+// Set cpustats_cg_online_map to the CPU's in cpuset, such as "0-3,8".
+static void
+cpustats_cg_parse_online(const char *cpuset)
+{
+        memset(cpustats_cg_online_map, 0,
+               cpustats_words * sizeof *cpustats_cg_online_map);
+        const char *p = cpuset;
+        while (*p) {
+                if (isspace(*p) || *p == ',') {
+                        ++p;
+                        continue;
+                }
+                char *end;
+                long lo = strtol(p, &end, 10), hi = lo;
+                if (end == p)
+                        panic("invalid cpu set: %s", cpuset);
+                if (*end == '-') {
+                        p = end + 1;
+                        hi = strtol(p, &end, 10);
+                        if (end == p || hi < lo)
+                                panic("invalid cpu set: %s", cpuset);
                 }
+                for (; lo <= hi && lo < cpustats_cpus; lo++)
+                        cpustats_cg_online_map[lo / 64] |=
+                                (uint64_t)1 << (lo % 64);
+                p = end;
         }
 }
 
-// Test if `a' and `b' have the same set of online CPU's.
-bool
-cpustats_sets_equal(const struct cpustats *a, const struct cpustats *b)
+static void
+cpustats_init_cgroup(void)
 {
-        if (a->max != b->max || a->online != b->online)
+        if (!cpustats_cgroup)
+                panic("the cgroup source needs a cgroup (-C)");
+        snprintf(cpustats_cg_path, sizeof cpustats_cg_path, "%s%s",
+                 cpustats_cgroup[0] == '/' ? "" : "/sys/fs/cgroup/",
+                 cpustats_cgroup);
+
+        // Each list has a number per possible CPU, so they're masked
+        // with the CPU's that are online
+        cpustats_cg_user = cpustats_cg_open("cpuacct.usage_percpu_user",
+                                            cpustats_cpus * 24);
+        if (cpustats_cg_user >= 0)
+                cpustats_cg_sys = cpustats_cg_open("cpuacct.usage_percpu_sys",
+                                                   cpustats_cpus * 24);
+        if (cpustats_cg_sys >= 0) {
+                int fd = open("/sys/devices/system/cpu/online", O_RDONLY);
+                if (fd < 0)
+                        epanic("failed to open /sys/devices/system/cpu/online");
+                cpustats_cg_online = batch_add(fd, 256, true);
+                cpustats_cg_online_map = malloc(
+                        cpustats_words * sizeof *cpustats_cg_online_map);
+                if (!cpustats_cg_online_map)
+                        epanic("allocating online CPU map");
+        }
+        if (cpustats_cg_sys < 0) {
+                cpustats_cg_stat = cpustats_cg_open("cpu.stat", 1024);
+                if (cpustats_cg_stat < 0)
+                        panic("%s is not a cgroup with CPU accounting",
+                              cpustats_cg_path);
+        }
+
+        if ((cpustats_cg_max = cpustats_cg_open("cpu.max", 64)) < 0) {
+                cpustats_cg_quota = cpustats_cg_open("cpu.cfs_quota_us", 64);
+                cpustats_cg_period = cpustats_cg_open("cpu.cfs_period_us", 64);
+        }
+        cpustats_cg_cpus = cpustats_cg_open("cpuset.cpus.effective", 256);
+}
+
+static void
+cpustats_read_cgroup(struct cpustats *out)
+{
+        int field;
+        for (field = 0; field < NFIELDS; field++)
+                out->field[field][-1] = 0;
+
+        unsigned long long val;
+        char *pos;
+        if (cpustats_cg_stat >= 0) {
+                // cpu.stat is lines of "key value", in microseconds
+                pos = cpustats_cg_get(cpustats_cg_stat, "cpu.stat");
+                while (*pos) {
+                        int field = -1;
+                        if (strncmp(pos, "user_usec ", 10) == 0)
+                                field = CPUSTAT_FIELD(user);
+                        else if (strncmp(pos, "system_usec ", 12) == 0)
+                                field = CPUSTAT_FIELD(sys);
+                        while (*pos && *pos != ' ' && *pos != '\n')
+                                pos++;
+                        if (field >= 0 && parse_ull(&pos, &val))
+                                out->field[field][-1] =
+                                        val / (1000000 / cpustats_clk_tck);
+                        while (*pos && *pos != '\n')
+                                pos++;
+                        if (*pos) pos++;
+                }
+        } else {
+                // Per-CPU lists, in nanoseconds.  Offline CPU's are
+                // listed too, but they'd only show as idle bars and
+                // dilute the average.
+                char *online = batch_get(cpustats_cg_online, NULL);
+                if (!online)
+                        epanic("failed to read /sys/devices/system/cpu/online");
+                cpustats_cg_parse_online(online);
+                int cpu;
+                pos = cpustats_cg_get(cpustats_cg_user,
+                                      "cpuacct.usage_percpu_user");
+                for (cpu = 0; cpu < cpustats_cpus && parse_ull(&pos, &val);
+                     cpu++) {
+                        if (!((cpustats_cg_online_map[cpu / 64] >>
+                               (cpu % 64)) & 1))
+                                continue;
+                        for (field = 0; field < NFIELDS; field++)
+                                out->field[field][cpu] = 0;
+                        CPUSTAT(out, user, cpu) =
+                                val / (1000000000 / cpustats_clk_tck);
+                        CPUSTAT(out, user, -1) += CPUSTAT(out, user, cpu);
+                        cpustats_set_online(out, cpu);
+                        out->online++;
+                        out->max = cpu;
+                }
+                pos = cpustats_cg_get(cpustats_cg_sys,
+                                      "cpuacct.usage_percpu_sys");
+                for (cpu = 0; cpu <= out->max && parse_ull(&pos, &val);
+                     cpu++) {
+                        if (!cpustats_online(out, cpu))
+                                continue;
+                        CPUSTAT(out, sys, cpu) =
+                                val / (1000000000 / cpustats_clk_tck);
+                        CPUSTAT(out, sys, -1) += CPUSTAT(out, sys, cpu);
+                }
+        }
+
+        // The quota is "max" or "-1" for none, and otherwise is in
+        // microseconds per period
+        unsigned long long quota = 0, period = 0;
+        if (cpustats_cg_max >= 0) {
+                pos = cpustats_cg_get(cpustats_cg_max, "cpu.max");
+                if (parse_ull(&pos, &quota))
+                        parse_ull(&pos, &period);
+        } else if (cpustats_cg_quota >= 0 && cpustats_cg_period >= 0) {
+                pos = cpustats_cg_get(cpustats_cg_quota, "cpu.cfs_quota_us");
+                if (parse_ull(&pos, &quota)) {
+                        pos = cpustats_cg_get(cpustats_cg_period,
+                                              "cpu.cfs_period_us");
+                        parse_ull(&pos, &period);
+                }
+        }
+        if (quota && period)
+                out->avg_capacity = MAX(quota * 1000 / period, 1);
+        else if (!out->online && cpustats_cg_cpus >= 0)
+                out->avg_capacity = 1000 * cpuset_count(
+                        cpustats_cg_get(cpustats_cg_cpus,
+                                        "cpuset.cpus.effective"));
+        else if (!out->online)
+                out->avg_capacity = 1000 * cpustats_cpus;
+}
+
+#ifdef __FreeBSD__
+// The sysctl source reads FreeBSD's own per-CPU tick counters from
+// kern.cp_times, an array of CPUSTATES longs per CPU.  That's one
+// system call with no text to parse, where going through linprocfs
+// has the kernel format the same counters as text for us to parse
+// back.  It doesn't need a procfs at all.
+
+// The fields of each CPU's kern.cp_times entries, as cpustats_columns
+static const int cpustats_cp_columns[CPUSTATES] = {
+        [CP_USER] = CPUSTAT_FIELD(user), [CP_NICE] = CPUSTAT_FIELD(nice),
+        [CP_SYS] = CPUSTAT_FIELD(sys), [CP_INTR] = CPUSTAT_FIELD(irq),
+        [CP_IDLE] = -1
+};
+static int cpustats_cp_mib[CTL_MAXNAME];
+static u_int cpustats_cp_miblen;
+static long *cpustats_cp_times;
+
+static void
+cpustats_init_sysctl(void)
+{
+        size_t miblen = CTL_MAXNAME;
+        if (sysctlnametomib("kern.cp_times", cpustats_cp_mib, &miblen))
+                epanic("failed to find kern.cp_times sysctl");
+        cpustats_cp_miblen = miblen;
+        cpustats_cp_times = malloc(cpustats_cpus * CPUSTATES *
+                                   sizeof *cpustats_cp_times);
+        if (!cpustats_cp_times)
+                epanic("allocating kern.cp_times buffer");
+
+        // The counters tick at stathz, not CLK_TCK
+        struct clockinfo clock;
+        size_t len = sizeof clock;
+        if (sysctlbyname("kern.clockrate", &clock, &len, NULL, 0))
+                epanic("failed to read kern.clockrate sysctl");
+        cpustats_clk_tck = clock.stathz ? clock.stathz : clock.hz;
+}
+
+static void
+cpustats_read_sysctl(struct cpustats *out)
+{
+        size_t len = cpustats_cpus * CPUSTATES * sizeof *cpustats_cp_times;
+        if (sysctl(cpustats_cp_mib, cpustats_cp_miblen, cpustats_cp_times,
+                   &len, NULL, 0))
+                epanic("failed to read kern.cp_times sysctl");
+        sys_calls++;
+
+        // There's no aggregate line, so sum it up as we go.  The
+        // fields cp_times doesn't have stay 0 from cpustats_alloc.
+        int ncpus = len / (CPUSTATES * sizeof *cpustats_cp_times);
+        int cpu, state, field;
+        for (state = 0; state < CPUSTATES; state++)
+                if ((field = cpustats_cp_columns[state]) != -1)
+                        out->field[field][-1] = 0;
+        for (cpu = 0; cpu < ncpus; cpu++) {
+                const long *times = &cpustats_cp_times[cpu * CPUSTATES];
+                // Absent CPU's have all zero counters
+                long any = 0;
+                for (state = 0; state < CPUSTATES; state++) {
+                        any |= times[state];
+                        if ((field = cpustats_cp_columns[state]) == -1)
+                                continue;
+                        out->field[field][cpu] = times[state];
+                        out->field[field][-1] += times[state];
+                }
+                if (!any)
+                        continue;
+                cpustats_set_online(out, cpu);
+                out->online++;
+                out->max = cpu;
+        }
+}
+#endif // __FreeBSD__
+
+// Sources of per-CPU statistics.  The first is the default.  init is
+// called once after the common setup in cpustats_init; read fills in
+// the CPU statistics of a snapshot, which cpustats_read has already
+// marked all offline.  procfs is whether the source needs a Linux-ish
+// procfs, which then also provides the load average.
+static const struct cpustats_source
+{
+        const char *name;
+        void (*init)(void);
+        void (*read)(struct cpustats *out);
+        bool procfs;
+} cpustats_sources[] = {
+#ifdef __FreeBSD__
+        {"sysctl", cpustats_init_sysctl, cpustats_read_sysctl, false},
+#endif
+        {"stat", cpustats_init_stat, cpustats_read_stat, true},
+        {"cgroup", cpustats_init_cgroup, cpustats_read_cgroup, true},
+        {NULL}
+};
+static const struct cpustats_source *cpustats_source;
+
+void
+cpustats_init(const char *source)
+{
+        for (cpustats_source = cpustats_sources; cpustats_source->name;
+             cpustats_source++)
+                if (!source || strcmp(source, cpustats_source->name) == 0)
+                        break;
+        if (!cpustats_source->name)
+                panic("unknown statistics source %s", source);
+
+        if (cpustats_source->procfs)
+                cpustats_findproc();
+
+        // Find the maximum number of CPU's we'll need, unless the
+        // caller already set it
+        if (!cpustats_cpus) {
+#ifdef __FreeBSD__
+                size_t oldlenp = sizeof(cpustats_cpus);
+                if (sysctlbyname("kern.smp.maxcpus", &cpustats_cpus,
+                                 &oldlenp, NULL, 0))
+                        epanic("failed to read kern.smp.maxcpus sysctl");
+#else
+                char *poss = read_all("/sys/devices/system/cpu/possible");
+                cpustats_cpus = cpuset_max(poss) + 1;
+                free(poss);
+#endif //__FreeBSD__
+        }
+        cpustats_words = (cpustats_cpus + 63) / 64;
+        cpustats_clk_tck = sysconf(_SC_CLK_TCK);
+
+        cpustats_load_batch = cpustats_source->procfs ?
+                batch_add(cpustats_load_fd, 128, false) : -1;
+
+        if (cpustats_source->init)
+                cpustats_source->init();
+}
+
+void
+cpustats_read(struct cpustats *out)
+{
+        memset(out->online_map, 0,
+               CPUSTATS_WORDS(out->cpus) * sizeof *out->online_map);
+        out->online = out->max = 0;
+        out->avg_capacity = 0;
+        out->real = time_usec() * cpustats_clk_tck / 1000000;
+
+        // Read this tick's files, including /proc/loadavg, which
+        // callers read right after, in one go
+        batch_read();
+        cpustats_source->read(out);
+}
+
+// Replace snapshot `old' with the difference between snapshot `new'
+// and it, in place.  Only CPU's online in both are computed, and the
+// rest are marked offline.
+void
+cpustats_delta(struct cpustats *old, const struct cpustats *new)
+{
+        old->real = new->real - old->real;
+        old->avg_capacity = new->avg_capacity;
+
+        int word, words = CPUSTATS_WORDS(old->cpus);
+        old->online = old->max = 0;
+        for (word = 0; word < words; word++) {
+                uint64_t bits = old->online_map[word] &= new->online_map[word];
+                if (bits) {
+                        old->online += __builtin_popcountll(bits);
+                        old->max = word * 64 + 63 - __builtin_clzll(bits);
+                }
+        }
+
+        int field;
+        for (field = 0; field < NFIELDS; field++) {
+                unsigned long long *o = old->field[field];
+                const unsigned long long *n = new->field[field];
+                o[-1] = n[-1] - o[-1];
+                for (word = 0; word < words; word++) {
+                        uint64_t bits = old->online_map[word];
+                        int base = word * 64;
+                        if (bits == ~(uint64_t)0) {
+                                // The common case of 64 online CPU's
+                                // is a loop the compiler vectorizes
+                                int cpu;
+                                for (cpu = base; cpu < base + 64; cpu++)
+                                        o[cpu] = n[cpu] - o[cpu];
+                                continue;
+                        }
+                        while (bits) {
+                                int cpu = base + __builtin_ctzll(bits);
+                                o[cpu] = n[cpu] - o[cpu];
+                                bits &= bits - 1;
+                        }
+                }
+        }
+}
+
+// Test if `a' and `b' have the same set of online CPU's.  They may
+// have room for different numbers of CPU's.
+bool
+cpustats_sets_equal(const struct cpustats *a, const struct cpustats *b)
+{
+        if (a->max != b->max || a->online != b->online)
+                return false;
+        // Both are offline past max
+        return memcmp(a->online_map, b->online_map,
+                      CPUSTATS_WORDS(a->max + 1) *
+                      sizeof *a->online_map) == 0;
+}
+
+/******************************************************************
+ * Topology
+ */
+
+// On big machines, bars can be aggregated by core (summing SMT
+// siblings), socket, or NUMA node, which keeps the display readable
+// and the frame size nearly independent of the number of CPU's.  The
+// view can also be narrowed to just the CPU's of one group.
+enum { TOPO_CPU, TOPO_CORE, TOPO_SOCKET, TOPO_NODE, NTOPO };
+static const char *topo_names[NTOPO] = {"cpu", "core", "socket", "node"};
+// topo_group[level][cpu] is the group containing cpu at each level.
+// Groups are numbered from 0 in order of their lowest CPU.
+static int *topo_group[NTOPO], topo_ngroups[NTOPO];
+// The current view: the level to aggregate at and, if non-negative,
+// the one group at that level whose CPU's to show individually
+static int topo_level, topo_only = -1;
+
+// Read a single number from a file under /sys/devices/system/cpu/cpuN.
+// Return -1 if it can't be read, for example because the CPU is
+// offline or the kernel doesn't report it.
+static int
+topo_read_id(int cpu, const char *name)
+{
+        char path[PATH_MAX], buf[32];
+        snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/%s",
+                 cpu, name);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return -1;
+        ssize_t len = readn_str(fd, buf, sizeof buf);
+        close(fd);
+        if (len <= 0 || !isdigit(buf[0]))
+                return -1;
+        return atoi(buf);
+}
+
+// Return the NUMA node of a CPU, which sysfs reports as a nodeN link
+// in the CPU's directory, or -1 if there isn't one.
+static int
+topo_read_node(int cpu)
+{
+        char path[PATH_MAX];
+        snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+        DIR *dir = opendir(path);
+        if (!dir)
+                return -1;
+        struct dirent *ent;
+        int node = -1;
+        while ((ent = readdir(dir)))
+                if (strncmp(ent->d_name, "node", 4) == 0 &&
+                    isdigit(ent->d_name[4])) {
+                        node = atoi(ent->d_name + 4);
+                        break;
+                }
+        closedir(dir);
+        return node;
+}
+
+// Number the distinct keys in key[0..cpustats_cpus) densely into
+// group.  Each key is a pair so cores can be keyed by socket and core
+// ID.
+static int
+topo_number(int *group, const int (*key)[2])
+{
+        int i, j, n = 0;
+        for (i = 0; i < cpustats_cpus; i++) {
+                for (j = 0; j < i; j++)
+                        if (key[j][0] == key[i][0] && key[j][1] == key[i][1])
+                                break;
+                group[i] = j < i ? group[j] : n++;
+        }
+        return n;
+}
+
+// Read the CPU topology.  This is only done once, so CPU's that are
+// offline at startup, whose topology the kernel doesn't report, each
+// get a core of their own.  Without any topology information (for
+// example, on FreeBSD) every CPU is its own core and there is one
+// socket and one node.
+void
+topo_init(void)
+{
+        int (*key)[2] = malloc(cpustats_cpus * sizeof *key);
+        if (!key)
+                epanic("allocating topology");
+        int level, i;
+        for (level = 0; level < NTOPO; level++) {
+                if (!(topo_group[level] =
+                      malloc(cpustats_cpus * sizeof *topo_group[level])))
+                        epanic("allocating topology");
+                for (i = 0; i < cpustats_cpus; i++) {
+                        int id = -1;
+                        key[i][0] = key[i][1] = 0;
+                        switch (level) {
+                        case TOPO_CPU:
+                                key[i][0] = i;
+                                break;
+                        case TOPO_CORE:
+                                id = topo_read_id(i, "topology/core_id");
+                                key[i][0] = topo_read_id(
+                                        i, "topology/physical_package_id");
+                                key[i][1] = id;
+                                break;
+                        case TOPO_SOCKET:
+                                id = key[i][0] = topo_read_id(
+                                        i, "topology/physical_package_id");
+                                break;
+                        case TOPO_NODE:
+                                id = key[i][0] = topo_read_node(i);
+                                break;
+                        }
+                        // Give CPU's without a core ID their own core,
+                        // and put CPU's of unknown socket or node
+                        // together.
+                        if (id < 0 && level == TOPO_CORE)
+                                key[i][0] = key[i][1] = -1 - i;
+                        else if (id < 0)
+                                key[i][0] = 0;
+                }
+                topo_ngroups[level] = topo_number(topo_group[level], key);
+        }
+        free(key);
+}
+
+// Build the current view of `in' in `out'.  Each group at topo_level
+// is summed into one entry of out->cpus or, if topo_only is set, out
+// keeps just the CPU's of that group and the average covers just
+// those.
+void
+topo_view(struct cpustats *out, const struct cpustats *in)
+{
+        if (!out->weight &&
+            !(out->weight = malloc(cpustats_cpus * sizeof *out->weight)))
+                epanic("allocating view weights");
+
+        const int *group = topo_group[topo_level];
+        int cpu, field;
+        cpustats_clear(out);
+        memset(out->weight, 0, cpustats_cpus * sizeof *out->weight);
+        out->real = in->real;
+        // The peaks of the CPU's say little about the peak of their
+        // sum
+        out->peak = out->p95 = NULL;
+        if (topo_only < 0) {
+                for (field = 0; field < NFIELDS; field++)
+                        out->field[field][-1] = in->field[field][-1];
+                out->avg_weight = in->online;
+                out->avg_capacity = in->avg_capacity;
+        } else {
+                out->avg_weight = 0;
+                out->avg_capacity = 0;
+        }
+
+        FOR_EACH_ONLINE(cpu, in) {
+                int pos = cpu;
+                if (topo_only < 0)
+                        pos = group[cpu];
+                else if (group[cpu] != topo_only)
+                        continue;
+                for (field = 0; field < NFIELDS; field++) {
+                        if (topo_only >= 0)
+                                out->field[field][-1] += in->field[field][cpu];
+                        out->field[field][pos] += in->field[field][cpu];
+                }
+                if (topo_only >= 0)
+                        out->avg_weight++;
+                if (!cpustats_online(out, pos)) {
+                        cpustats_set_online(out, pos);
+                        out->online++;
+                        out->max = MAX(out->max, pos);
+                }
+                out->weight[pos]++;
+        }
+}
+
+// Describe the current view for the status line, or return "" for
+// the plain per-CPU view.
+const char *
+topo_describe(void)
+{
+        static char buf[64];
+        if (topo_level == TOPO_CPU)
+                return "";
+        if (topo_only < 0)
+                snprintf(buf, sizeof buf, "by %s", topo_names[topo_level]);
+        else
+                snprintf(buf, sizeof buf, "CPU's of %s %d of %d",
+                         topo_names[topo_level], topo_only,
+                         topo_ngroups[topo_level]);
+        return buf;
+}
+
+/******************************************************************
+ * Processes
+ */
+
+// The process pane lists the threads using the most CPU.  Reading
+// every thread's stat file every tick doesn't scale to hosts with
+// tens of thousands of threads, so each tick reads only the threads
+// that were busiest last time plus the next PROC_SCAN_TICK threads
+// in turn.  Each thread's rate is over the time since its own last
+// read.  The list of threads is only rescanned every
+// PROC_RESCAN_USEC, and stat files stay open between reads, as many
+// as the file descriptor limit allows.
+
+#define PROC_SCAN_TICK 1024
+#define PROC_HOT 32
+#define PROC_RESCAN_USEC 5000000
+
+static struct proc_task
+{
+        // The thread ID, or -1 if it exited
+        int tid;
+        // Its open stat file, or -1
+        int fd;
+        // Its user plus system time in clock ticks, and when we got it
+        unsigned long long time;
+        uint64_t when;
+        // How much CPU it used between its last two reads, in
+        // thousandths of a CPU, and the CPU it last ran on
+        int rate, cpu;
+        char comm[16];
+} *proc_tasks;
+static int proc_ntasks, proc_tasks_cap;
+// The next thread to read in turn
+static int proc_next;
+// The busiest threads, as indexes into proc_tasks
+static int proc_hot[PROC_HOT], proc_nhot;
+// How many stat files we have open, and may have open
+static int proc_open_fds, proc_max_fds;
+static uint64_t proc_scanned;
+
+static int
+proc_compare_tids(const void *a, const void *b)
+{
+        return *(const int *)a - *(const int *)b;
+}
+
+// Add the IDs of the threads of every process to *tids.
+static int
+proc_list(int **tids)
+{
+        int n = 0, cap = 1024;
+        if (!(*tids = malloc(cap * sizeof **tids)))
+                epanic("allocating thread list");
+        DIR *procs = opendir(proc_path);
+        if (!procs)
+                epanic("failed to open %s", proc_path);
+        struct dirent *pd, *td;
+        while ((pd = readdir(procs))) {
+                if (!isdigit(pd->d_name[0]))
+                        continue;
+                char path[PATH_MAX];
+                snprintf(path, sizeof path, "%s/%s/task", proc_path,
+                         pd->d_name);
+                DIR *tasks = opendir(path);
+                if (!tasks)
+                        continue;
+                while ((td = readdir(tasks))) {
+                        if (!isdigit(td->d_name[0]))
+                                continue;
+                        if (n == cap && !(*tids = realloc(*tids, (cap *= 2) *
+                                                          sizeof **tids)))
+                                epanic("allocating thread list");
+                        (*tids)[n++] = atoi(td->d_name);
+                }
+                closedir(tasks);
+        }
+        closedir(procs);
+        qsort(*tids, n, sizeof **tids, proc_compare_tids);
+        return n;
+}
+
+static void
+proc_close(struct proc_task *task)
+{
+        if (task->fd >= 0) {
+                close(task->fd);
+                proc_open_fds--;
+                task->fd = -1;
+        }
+}
+
+// Rescan the thread list, keeping what we know about threads that
+// are still around.  Both lists are sorted by thread ID, so this is a
+// merge.
+static void
+proc_rescan(void)
+{
+        int *tids, n = proc_list(&tids), i = 0, j = 0, k = 0;
+        struct proc_task *tasks = malloc(MAX(n, 1) * sizeof *tasks);
+        if (!tasks)
+                epanic("allocating threads");
+        while (j < n) {
+                if (i < proc_ntasks && (proc_tasks[i].tid < 0 ||
+                                        proc_tasks[i].tid < tids[j])) {
+                        proc_close(&proc_tasks[i++]);
+                        continue;
+                }
+                if (i < proc_ntasks && proc_tasks[i].tid == tids[j]) {
+                        tasks[k++] = proc_tasks[i++];
+                } else {
+                        memset(&tasks[k], 0, sizeof tasks[k]);
+                        tasks[k].tid = tids[j];
+                        tasks[k].fd = -1;
+                        tasks[k].cpu = -1;
+                        k++;
+                }
+                j++;
+        }
+        for (; i < proc_ntasks; i++)
+                proc_close(&proc_tasks[i]);
+        free(proc_tasks);
+        free(tids);
+        proc_tasks = tasks;
+        proc_ntasks = k;
+        proc_tasks_cap = MAX(n, 1);
+        proc_nhot = 0;
+        if (proc_next >= proc_ntasks)
+                proc_next = 0;
+}
+
+// Read the stat file of task and update its rate.
+static void
+proc_read(struct proc_task *task, uint64_t now)
+{
+        if (task->tid < 0)
+                return;
+        int fd = task->fd;
+        if (fd < 0) {
+                char path[PATH_MAX];
+                snprintf(path, sizeof path, "%s/%d/task/%d/stat",
+                         proc_path, task->tid, task->tid);
+                // Threads other than the main one aren't listed in
+                // /proc, but are still reachable through it
+                fd = open(path, O_RDONLY);
+                sys_calls++;
+                if (fd < 0) {
+                        task->tid = -1;
+                        return;
+                }
+                if (proc_open_fds < proc_max_fds) {
+                        task->fd = fd;
+                        proc_open_fds++;
+                }
+        }
+
+        char buf[512];
+        ssize_t len = pread(fd, buf, sizeof buf - 1, 0);
+        sys_calls++;
+        if (task->fd < 0) {
+                close(fd);
+                sys_calls++;
+        }
+        if (len <= 0) {
+                // It exited
+                proc_close(task);
+                task->tid = -1;
+                task->rate = 0;
+                return;
+        }
+        buf[len] = 0;
+
+        // The command name is in parentheses and may contain anything,
+        // so the fields start after the last ')'.  The first of those
+        // is field 3.
+        char *open = strchr(buf, '('), *close = strrchr(buf, ')');
+        if (!open || !close || close < open)
+                return;
+        int n = MIN(close - open - 1, (int)sizeof task->comm - 1);
+        memcpy(task->comm, open + 1, n);
+        task->comm[n] = 0;
+        char *pos = close + 2;
+        unsigned long long val, utime = 0, stime = 0;
+        int field;
+        for (field = 3; field <= 39 && *pos; field++) {
+                while (*pos == ' ')
+                        pos++;
+                if (parse_ull(&pos, &val)) {
+                        if (field == 14)
+                                utime = val;
+                        else if (field == 15)
+                                stime = val;
+                        else if (field == 39)
+                                task->cpu = val;
+                }
+                while (*pos && *pos != ' ')
+                        pos++;
+        }
+
+        unsigned long long time = utime + stime;
+        if (task->when && now > task->when && time >= task->time)
+                task->rate = (time - task->time) * 1000 * 1000000 /
+                        (cpustats_clk_tck * (now - task->when));
+        task->time = time;
+        task->when = now;
+}
+
+// Raise our file descriptor limit as far as we may, and keep some of
+// it for everything else.  This waits until the process pane is
+// first shown, since nothing else needs the descriptors.
+void
+proc_init(void)
+{
+        static bool initialized;
+        if (initialized)
+                return;
+        initialized = true;
+        struct rlimit lim;
+        if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+                lim.rlim_cur = lim.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &lim);
+                getrlimit(RLIMIT_NOFILE, &lim);
+                proc_max_fds = MAX((long long)MIN(lim.rlim_cur, 1 << 20) - 64,
+                                   0LL);
+        }
+}
+
+// Read the threads due this tick and find the busiest.
+void
+proc_update(void)
+{
+        uint64_t now = time_usec();
+        if (!proc_scanned || now - proc_scanned >= PROC_RESCAN_USEC) {
+                proc_rescan();
+                proc_scanned = now;
+        }
+
+        int i, j;
+        for (i = 0; i < proc_nhot; i++)
+                proc_read(&proc_tasks[proc_hot[i]], now);
+        for (i = 0; i < MIN(PROC_SCAN_TICK, proc_ntasks); i++) {
+                proc_read(&proc_tasks[proc_next], now);
+                proc_next = (proc_next + 1) % proc_ntasks;
+        }
+
+        // Keep the busiest threads in order, by insertion
+        proc_nhot = 0;
+        for (i = 0; i < proc_ntasks; i++) {
+                int rate = proc_tasks[i].rate;
+                if (proc_tasks[i].tid < 0 || rate <= 0 ||
+                    (proc_nhot == PROC_HOT &&
+                     rate <= proc_tasks[proc_hot[PROC_HOT - 1]].rate))
+                        continue;
+                j = MIN(proc_nhot, PROC_HOT - 1);
+                for (; j > 0 && proc_tasks[proc_hot[j - 1]].rate < rate; j--)
+                        proc_hot[j] = proc_hot[j - 1];
+                proc_hot[j] = i;
+                proc_nhot = MIN(proc_nhot + 1, PROC_HOT);
+        }
+}
+
+/******************************************************************
+ * Recording
+ */
+
+// A recording is a header followed by a sequence of records.  All
+// integers are unsigned LEB128 varints; signed integers are
+// zigzag-encoded first.
+//
+// The header is the magic "cpubars\n", followed by the format version
+// (REC_VERSION), the clock ticks per second, the number of CPU's
+// (cpustats_cpus), the number of counters per CPU (REC_NFIELDS), and
+// the start time in microseconds since the Unix epoch.
+//
+// Each record is a type byte, the length of the rest of the record,
+// and the rest of the record, which depends on the type:
+//
+// 'K' (keyframe) is the time in microseconds since the start.  In
+// version 1, it was followed by the online CPU bitmap and the
+// absolute counters, which nothing read, and playback skips them.
+//
+// 'D' (delta) is the time in microseconds since the previous record,
+// the elapsed real time in clock ticks, the three load averages times
+// 100, a flags byte, and, if flags has REC_ONLINE set, a new online
+// bitmap (cpustats_cpus bits, rounded up to bytes) for the delta.
+// Then come the counters of the aggregate line and of each online
+// CPU, which are stored as the difference between this delta and the
+// same CPU's delta in the previous record (or 0 if it wasn't
+// online).  Since most CPU's are either idle or
+// steadily busy, these are almost always 0, so they are stored
+// sparsely: each entry is the number of CPU's skipped since the last
+// entry, a bitmask of the non-zero counters, and those counters.
+// The aggregate line counts as the first online CPU.
+//
+// For an idle machine, a delta record is about a dozen bytes.
+//
+// A keyframe is written every REC_KEYFRAME_RECORDS records.  The deltas
+// after a keyframe don't depend on anything before it, so a player can
+// start decoding at any keyframe, and it needs no other state.
+//
+// When recording stops cleanly, it writes an 'I' (index) record, which
+// is the number of keyframes and, for each keyframe, its time and
+// file offset, each relative to the previous keyframe's.  This is
+// followed by an 8-byte little-endian file offset of the 'I' record
+// and the magic REC_INDEX_MAGIC, which end the file.
+
+#define REC_MAGIC "cpubars\n"
+#define REC_INDEX_MAGIC "cpubidx\n"
+#define REC_VERSION 2
+#define REC_ONLINE 0x01
+#define REC_KEYFRAME_RECORDS 1000
+
+// We record every counter, in struct cpustat order
+#define REC_NFIELDS NFIELDS
+
+// The previous delta, which the next delta is relative to
+static struct cpustats *rec_prev;
+static uint64_t rec_start, rec_last;
+// Records since the last keyframe
+static int rec_count;
+
+// The index of keyframes in a recording
+static struct rec_index
+{
+        uint64_t time;
+        off_t offset;
+} *rec_index;
+static int rec_index_len, rec_index_cap;
+// Whether rec_keyframe adds to the index.  Only recordings to a file
+// end with one; served streams never do, and may run forever.
+static bool rec_indexed;
+
+static void
+rec_index_add(uint64_t time, off_t offset)
+{
+        if (rec_index_len == rec_index_cap) {
+                rec_index_cap = rec_index_cap ? 2 * rec_index_cap : 64;
+                rec_index = realloc(rec_index,
+                                    rec_index_cap * sizeof *rec_index);
+                if (!rec_index)
+                        epanic("allocating keyframe index");
+        }
+        rec_index[rec_index_len].time = time;
+        rec_index[rec_index_len].offset = offset;
+        rec_index_len++;
+}
+
+static void
+rec_put(unsigned long long val)
+{
+        char buf[10];
+        int n = 0;
+        do {
+                buf[n++] = (val & 0x7f) | (val > 0x7f ? 0x80 : 0);
+                val >>= 7;
+        } while (val);
+        out_write(buf, n);
+}
+
+static void
+rec_put_signed(long long val)
+{
+        rec_put(((unsigned long long)val << 1) ^ (val >> 63));
+}
+
+// Start a record of the given type.  Returns a cookie for rec_end.
+static size_t
+rec_begin(char type)
+{
+        out_putc(type);
+        return out_len;
+}
+
+// Finish a record by inserting its length before its contents.
+static void
+rec_end(size_t start)
+{
+        size_t len = out_len - start;
+        size_t hdr = out_len;
+        rec_put(len);
+        size_t n = out_len - hdr;
+        char buf[10];
+        memcpy(buf, out_buf + hdr, n);
+        memmove(out_buf + start + n, out_buf + start, len);
+        memcpy(out_buf + start, buf, n);
+}
+
+static void
+rec_put_online(const struct cpustats *st)
+{
+        int i, bit;
+        for (i = 0; i < cpustats_cpus; i += 8) {
+                unsigned char byte = 0;
+                for (bit = 0; bit < 8 && i + bit < cpustats_cpus; bit++)
+                        if (cpustats_online(st, i + bit))
+                                byte |= 1 << bit;
+                out_putc(byte);
+        }
+}
+
+// Write a keyframe.
+void
+rec_keyframe(void)
+{
+        uint64_t now = time_usec();
+        if (rec_indexed)
+                rec_index_add(now - rec_start, out_total_bytes + out_len);
+        size_t rec = rec_begin('K');
+        rec_put(now - rec_start);
+        rec_last = now;
+        rec_end(rec);
+        out_flush();
+
+        // The next delta doesn't depend on earlier ones
+        cpustats_clear(rec_prev);
+        rec_count = 0;
+}
+
+// Start recording and output the header, without flushing it.
+static void
+rec_header(void)
+{
+        rec_start = time_usec();
+        out_write(REC_MAGIC, strlen(REC_MAGIC));
+        rec_put(REC_VERSION);
+        rec_put(cpustats_clk_tck);
+        rec_put(cpustats_cpus);
+        rec_put(REC_NFIELDS);
+        rec_put(time_wall_usec());
+
+        rec_prev = cpustats_alloc();
+}
+
+void
+rec_open(const char *path)
+{
+        if (strcmp(path, "-") == 0)
+                out_fd = 1;
+        else if ((out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+                epanic("failed to create %s", path);
+
+        rec_header();
+        rec_indexed = true;
+        rec_keyframe();
+}
+
+// Finish a recording by writing the keyframe index.
+void
+rec_close(void)
+{
+        off_t offset = out_total_bytes + out_len;
+        size_t rec = rec_begin('I');
+        rec_put(rec_index_len);
+        int i;
+        for (i = 0; i < rec_index_len; i++) {
+                rec_put(rec_index[i].time - (i ? rec_index[i-1].time : 0));
+                rec_put(rec_index[i].offset - (i ? rec_index[i-1].offset : 0));
+        }
+        rec_end(rec);
+        for (i = 0; i < 8; i++)
+                out_putc((uint64_t)offset >> (8 * i));
+        out_write(REC_INDEX_MAGIC, strlen(REC_INDEX_MAGIC));
+        out_flush();
+}
+
+void
+rec_delta(const struct cpustats *delta, float load[3])
+{
+        uint64_t now = time_usec();
+        size_t rec = rec_begin('D');
+        rec_put(now - rec_last);
+        rec_last = now;
+        rec_put(delta->real);
+        int i;
+        for (i = 0; i < 3; i++)
+                rec_put(load[i] * 100 + 0.5);
+        bool changed = !cpustats_sets_equal(delta, rec_prev);
+        out_putc(changed ? REC_ONLINE : 0);
+        if (changed)
+                rec_put_online(delta);
+
+        int skip = 0, field;
+        for (i = -1; i < cpustats_cpus; i++) {
+                if (i != -1 && !cpustats_online(delta, i))
+                        continue;
+                // Counters of CPU's that just came online are
+                // relative to 0
+                bool had = i == -1 || cpustats_online(rec_prev, i);
+                long long diff[REC_NFIELDS];
+                unsigned mask = 0;
+                for (field = 0; field < REC_NFIELDS; field++) {
+                        diff[field] = delta->field[field][i] -
+                                (had ? rec_prev->field[field][i] : 0);
+                        if (diff[field])
+                                mask |= 1 << field;
+                }
+                if (!mask) {
+                        skip++;
+                        continue;
+                }
+                rec_put(skip);
+                rec_put(mask);
+                for (field = 0; field < REC_NFIELDS; field++)
+                        if (mask & (1 << field))
+                                rec_put_signed(diff[field]);
+                skip = 0;
+        }
+        rec_end(rec);
+        out_flush();
+
+        // Remember this delta for the next one
+        cpustats_copy(rec_prev, delta);
+        rec_count++;
+}
+
+/******************************************************************
+ * Playback
+ */
+
+static FILE *play_fp;
+static const char *play_path;
+// The start time of the recording in microseconds since the epoch
+static uint64_t play_start;
+// The time of the last record read, in microseconds since the start
+static uint64_t play_time;
+// Whether we've reached the end of the recording
+static bool play_eof;
+// Records are decoded from memory, from play_pos up to play_end.
+// play_buf holds the record read from the file.
+static const unsigned char *play_pos, *play_end;
+static unsigned char *play_buf;
+static size_t play_buf_cap;
+// A bad stream from one server shouldn't take down the whole
+// dashboard, so with play_soft set, decoding errors don't panic.
+// play_fail leaves the first one in play_error instead, and the rest
+// of the record decodes as zeros.
+static bool play_soft;
+static const char *play_error;
+// The most CPU's a header may claim, well past what any kernel
+// supports, so a corrupt one can't ask for a huge allocation
+#define PLAY_MAX_CPUS (1 << 16)
+
+static void
+play_fail(const char *what)
+{
+        if (!play_soft)
+                panic("%s: %s", play_path, what);
+        if (!play_error)
+                play_error = what;
+        play_pos = play_end;
+}
+
+static int
+play_getc(void)
+{
+        if (play_pos == play_end) {
+                play_fail("truncated");
+                return 0;
+        }
+        return *play_pos++;
+}
+
+static unsigned long long
+play_get(void)
+{
+        unsigned long long val = 0;
+        int shift = 0, ch;
+        do {
+                ch = play_getc();
+                if (shift < 64)
+                        val |= (unsigned long long)(ch & 0x7f) << shift;
+                shift += 7;
+        } while (ch & 0x80);
+        return val;
+}
+
+static long long
+play_get_signed(void)
+{
+        unsigned long long val = play_get();
+        return (val >> 1) ^ -(val & 1);
+}
+
+// Return the length of the n varints at the start of buf, or 0 if
+// they aren't all in the first len bytes.
+static size_t
+play_varints_len(const unsigned char *buf, size_t len, int n)
+{
+        size_t pos = 0;
+        while (n--) {
+                while (pos < len && (buf[pos] & 0x80))
+                        pos++;
+                if (pos++ >= len)
+                        return 0;
+        }
+        return pos;
+}
+
+// Return the length of the recording header at the start of buf, or
+// 0 if it isn't all in the first len bytes.
+size_t
+play_header_len(const unsigned char *buf, size_t len)
+{
+        size_t magic = strlen(REC_MAGIC);
+        if (len < magic)
+                return 0;
+        size_t n = play_varints_len(buf + magic, len - magic, 5);
+        return n ? magic + n : 0;
+}
+
+// Decode a recording header from len bytes at buf, and return the
+// number of CPU's it records.
+int
+play_header(const unsigned char *buf, size_t len)
+{
+        size_t magic = strlen(REC_MAGIC);
+        if (len < magic || memcmp(buf, REC_MAGIC, magic) != 0) {
+                play_fail("not a cpubars recording");
+                return 0;
+        }
+        play_pos = buf + magic;
+        play_end = buf + len;
+        // Version 1 only differs in what its keyframes carry
+        unsigned long long version = play_get();
+        if (version < 1 || version > REC_VERSION) {
+                play_fail("unsupported recording version");
+                return 0;
+        }
+        cpustats_clk_tck = play_get();
+        unsigned long long cpus = play_get();
+        if (cpus < 1 || cpus > PLAY_MAX_CPUS) {
+                play_fail("corrupt header");
+                return 0;
+        }
+        if (play_get() != REC_NFIELDS) {
+                play_fail("unsupported number of counters");
+                return 0;
+        }
+        play_start = play_get();
+        return cpus;
+}
+
+// Return the length of the record at the start of buf, including its
+// type and length, or 0 if it isn't all in the first len bytes, or
+// SIZE_MAX if its contents are longer than max.  If it is all there,
+// point play_pos and play_end at its contents, ready for play_record.
+size_t
+play_record_len(const unsigned char *buf, size_t len, size_t max)
+{
+        size_t hdr = len ? play_varints_len(buf + 1, len - 1, 1) : 0;
+        if (!hdr)
+                return 0;
+        play_pos = buf + 1;
+        play_end = buf + 1 + hdr;
+        unsigned long long n = play_get();
+        if (n > max)
+                return SIZE_MAX;
+        if (n > len - 1 - hdr)
+                return 0;
+        play_end = play_pos + n;
+        return 1 + hdr + n;
+}
+
+// Read a varint from the file, for walking records without reading
+// them.
+static unsigned long long
+play_file_get(void)
+{
+        unsigned char buf[10];
+        int n = 0, ch;
+        do {
+                if ((ch = getc(play_fp)) == EOF)
+                        panic("%s: truncated", play_path);
+                if (n < sizeof buf)
+                        buf[n++] = ch;
+        } while (ch & 0x80);
+        play_pos = buf;
+        play_end = buf + n;
+        return play_get();
+}
+
+// Read the next record from the file into play_buf and point play_pos
+// at its contents.  Return its type, or EOF at the end of the file.
+static int
+play_read_record(void)
+{
+        int type = getc(play_fp);
+        if (type == EOF)
+                return EOF;
+        size_t len = play_file_get();
+        if (len > play_buf_cap) {
+                free(play_buf);
+                play_buf_cap = MAX(len, 2 * play_buf_cap);
+                if (!(play_buf = malloc(play_buf_cap)))
+                        epanic("allocating record buffer");
+        }
+        if (fread(play_buf, 1, len, play_fp) != len)
+                panic("%s: truncated", play_path);
+        play_pos = play_buf;
+        play_end = play_buf + len;
+        return type;
+}
+
+// Read an online bitmap into delta.  CPU's that weren't online before
+// have their counters cleared, since their next delta is relative to
+// 0.
+static void
+play_get_online(struct cpustats *delta)
+{
+        int i, bit;
+        delta->online = delta->max = 0;
+        for (i = 0; i < delta->cpus; i += 8) {
+                int byte = play_getc();
+                for (bit = 0; bit < 8 && i + bit < delta->cpus; bit++) {
+                        int cpu = i + bit;
+                        bool online = byte & (1 << bit);
+                        if (online && !cpustats_online(delta, cpu)) {
+                                int field;
+                                for (field = 0; field < NFIELDS; field++)
+                                        delta->field[field][cpu] = 0;
+                        }
+                        delta->online_map[cpu / 64] &=
+                                ~((uint64_t)1 << (cpu % 64));
+                        if (online) {
+                                cpustats_set_online(delta, cpu);
+                                delta->online++;
+                                delta->max = cpu;
+                        }
+                }
+        }
+}
+
+// Build the keyframe index of a recording that doesn't have one by
+// skipping from record to record.  This reads only record headers.
+static void
+play_scan_index(off_t pos)
+{
+        while (1) {
+                if (fseeko(play_fp, pos, SEEK_SET) < 0)
+                        epanic("failed to seek %s", play_path);
+                int type = getc(play_fp);
+                if (type == EOF)
+                        break;
+                unsigned long long len = play_file_get();
+                off_t data = ftello(play_fp);
+                if (type == 'I')
+                        break;
+                if (type == 'K')
+                        rec_index_add(play_file_get(), pos);
+                pos = data + len;
+        }
+        clearerr(play_fp);
+}
+
+// Open a recording for playback and set up cpustats accordingly.
+void
+play_open(const char *path)
+{
+        play_path = path;
+        if (!(play_fp = fopen(path, "rb")))
+                epanic("failed to open %s", path);
+        unsigned char header[64];
+        size_t len = fread(header, 1, sizeof header, play_fp);
+        cpustats_cpus = play_header(header, len);
+        cpustats_words = CPUSTATS_WORDS(cpustats_cpus);
+        off_t first = play_header_len(header, len);
+        if (!first)
+                panic("%s: truncated", path);
+
+        // Use the index at the end of the file if there is one
+        unsigned char footer[16];
+        if (fseeko(play_fp, -16, SEEK_END) == 0 &&
+            fread(footer, 1, sizeof footer, play_fp) == sizeof footer &&
+            memcmp(footer + 8, REC_INDEX_MAGIC, 8) == 0) {
+                off_t offset = 0;
+                int i;
+                for (i = 0; i < 8; i++)
+                        offset |= (off_t)footer[i] << (8 * i);
+                if (fseeko(play_fp, offset, SEEK_SET) < 0 ||
+                    play_read_record() != 'I')
+                        panic("%s: corrupt index", path);
+                int n = play_get();
+                uint64_t time = 0;
+                off_t pos = 0;
+                for (i = 0; i < n; i++) {
+                        time += play_get();
+                        pos += play_get();
+                        rec_index_add(time, pos);
+                }
+        } else {
+                clearerr(play_fp);
+                play_scan_index(first);
+        }
+        if (rec_index_len == 0)
+                panic("%s: no keyframes", path);
+        if (fseeko(play_fp, first, SEEK_SET) < 0)
+                epanic("failed to seek %s", path);
+}
+
+// Apply a record of the given type, whose contents are at play_pos,
+// to delta.  delta must be the same cpustats as for the previous
+// record, since records are relative to each other.  Return true if
+// this was a delta record, which leaves a new delta to show.
+bool
+play_record(int type, struct cpustats *delta, float load[3])
+{
+        if (type == 'K') {
+                // Deltas after this are relative to 0
+                play_time = play_get();
+                cpustats_clear(delta);
+                return false;
+        }
+        if (type != 'D')
+                return false;
+
+        play_time += play_get();
+        delta->real = play_get();
+        int i;
+        for (i = 0; i < 3; i++)
+                load[i] = play_get() / 100.0;
+        int flags = play_getc();
+        if (flags & REC_ONLINE)
+                play_get_online(delta);
+
+        // Apply the sparse changes.  cpu walks the aggregate line (-1)
+        // and then the online CPU's.
+        int cpu = -2;
+        while (play_pos < play_end) {
+                unsigned long long skip = play_get();
+                do {
+                        if (cpu == -2)
+                                cpu = -1;
+                        else if ((cpu = cpustats_next(delta, cpu + 1)) < 0)
+                                cpu = delta->cpus;
+                } while (skip-- && cpu < delta->cpus);
+                if (cpu >= delta->cpus) {
+                        play_fail("corrupt delta");
+                        return false;
+                }
+                unsigned mask = play_get();
+                int field;
+                for (field = 0; field < REC_NFIELDS; field++)
+                        if (mask & (1 << field))
+                                delta->field[field][cpu] += play_get_signed();
+        }
+        return true;
+}
+
+// Read the next delta record of the file into delta, like
+// play_record.  Returns false at the end of the recording.
+bool
+play_next(struct cpustats *delta, float load[3])
+{
+        while (!play_eof) {
+                int type = play_read_record();
+                if (type == EOF || type == 'I') {
+                        play_eof = true;
+                        return false;
+                }
+                if (play_record(type, delta, load))
+                        return true;
+        }
+        return false;
+}
+
+// Seek to time (in microseconds since the start) and read the first
+// delta at or after it, like play_next.
+bool
+play_seek(struct cpustats *delta, float load[3], uint64_t time)
+{
+        // Find the last keyframe at or before time
+        int lo = 0, hi = rec_index_len;
+        while (hi - lo > 1) {
+                int mid = (lo + hi) / 2;
+                if (rec_index[mid].time <= time)
+                        lo = mid;
+                else
+                        hi = mid;
+        }
+        if (fseeko(play_fp, rec_index[lo].offset, SEEK_SET) < 0)
+                epanic("failed to seek %s", play_path);
+        play_eof = false;
+
+        // Decode from there
+        while (play_next(delta, load))
+                if (play_time >= time)
+                        return true;
+        return false;
+}
+
+/******************************************************************
+ * Network
+ */
+
+// A server streams a recording, minus the index, to each client over
+// TCP.  Each client gets the header when it connects, followed by a
+// keyframe, which goes to every client since it doesn't hurt to
+// restart the others' deltas.  Every record is built once and then
+// sent to each client in turn, so the cost of sampling doesn't depend
+// on the number of clients.
+
+// The most a client can fall behind by before we drop it
+#define NET_SNDBUF (1 << 20)
+
+static int net_listen_fd = -1;
+static int *net_clients, net_nclients, net_clients_cap;
+// The recording header, which each client gets first
+static char *net_header;
+static size_t net_header_len;
+
+// Split "HOST:PORT", "[HOST]:PORT", or just "PORT" into host (NULL
+// if there's none) and port.  These point into a copy of spec, which
+// is returned for the caller to free.
+static char *
+net_split(const char *spec, char **host, char **port)
+{
+        char *copy = strdup(spec);
+        if (!copy)
+                epanic("allocating address");
+        char *colon = strrchr(copy, ':');
+        if (!colon) {
+                *host = NULL;
+                *port = copy;
+                return copy;
+        }
+        *colon = 0;
+        *host = copy;
+        *port = colon + 1;
+        if (copy[0] == '[' && colon > copy && colon[-1] == ']') {
+                colon[-1] = 0;
+                (*host)++;
+        }
+        return copy;
+}
+
+static struct addrinfo *
+net_resolve(const char *spec, bool passive)
+{
+        char *host, *port, *copy = net_split(spec, &host, &port);
+        struct addrinfo hints = {
+                .ai_socktype = SOCK_STREAM,
+                .ai_flags = passive ? AI_PASSIVE : 0
+        }, *res;
+        int err = getaddrinfo(host, port, &hints, &res);
+        if (err)
+                panic("%s: %s", spec, gai_strerror(err));
+        free(copy);
+        return res;
+}
+
+// Start listening for clients on [HOST:]PORT.
+void
+net_listen(const char *spec)
+{
+        struct addrinfo *res = net_resolve(spec, true), *ai;
+        for (ai = res; ai; ai = ai->ai_next) {
+                int fd = socket(ai->ai_family, ai->ai_socktype,
+                                ai->ai_protocol);
+                if (fd < 0)
+                        continue;
+                int on = 1;
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+                if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+                    listen(fd, 16) == 0) {
+                        net_listen_fd = fd;
+                        break;
+                }
+                close(fd);
+        }
+        if (net_listen_fd < 0)
+                epanic("failed to listen on %s", spec);
+        freeaddrinfo(res);
+        fcntl(net_listen_fd, F_SETFL, O_NONBLOCK);
+}
+
+// Take the recording header from the output buffer, to send to each
+// client as it connects.
+void
+net_save_header(void)
+{
+        if (!(net_header = malloc(out_len)))
+                epanic("allocating header");
+        memcpy(net_header, out_buf, out_len);
+        net_header_len = out_len;
+        out_len = 0;
+}
+
+static void
+net_drop(int i)
+{
+        close(net_clients[i]);
+        net_clients[i] = net_clients[--net_nclients];
+}
+
+// Send buf to every client.  A client that can't take all of it has
+// fallen too far behind, and since the rest of the stream depends on
+// this record, it's dropped.
+void
+net_send(const char *buf, size_t len)
+{
+        int i;
+        for (i = 0; i < net_nclients; i++) {
+                ssize_t r = send(net_clients[i], buf, len,
+                                 MSG_DONTWAIT | MSG_NOSIGNAL);
+                sys_calls++;
+                if (r != (ssize_t)len)
+                        net_drop(i--);
+        }
+}
+
+// Accept waiting clients and send them the header.  Returns true if
+// there were any, in which case the caller must start a keyframe.
+bool
+net_accept(void)
+{
+        bool any = false;
+        int fd;
+        while ((fd = accept(net_listen_fd, NULL, NULL)) >= 0) {
+                int on = 1, size = NET_SNDBUF;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+                setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+                if (send(fd, net_header, net_header_len,
+                         MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)net_header_len) {
+                        close(fd);
+                        continue;
+                }
+                if (net_nclients == net_clients_cap) {
+                        net_clients_cap = net_clients_cap ?
+                                2 * net_clients_cap : 16;
+                        net_clients = realloc(net_clients, net_clients_cap *
+                                              sizeof *net_clients);
+                        if (!net_clients)
+                                epanic("allocating clients");
+                }
+                net_clients[net_nclients++] = fd;
+                any = true;
+        }
+        return any;
+}
+
+// Start connecting to a server at HOST:PORT.  The connection
+// finishes in the background; if it fails, reading from the socket
+// returns the error.
+int
+net_connect(const char *spec)
+{
+        struct addrinfo *res = net_resolve(spec, false), *ai;
+        int fd = -1;
+        for (ai = res; ai; ai = ai->ai_next) {
+                if ((fd = socket(ai->ai_family, ai->ai_socktype,
+                                 ai->ai_protocol)) < 0)
+                        continue;
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 ||
+                    errno == EINPROGRESS)
+                        break;
+                close(fd);
+                fd = -1;
+        }
+        if (fd < 0)
+                epanic("failed to connect to %s", spec);
+        freeaddrinfo(res);
+        return fd;
+}
+
+// Wait for input on any number of file descriptors.  Each watched fd
+// has an id, which net_wait returns when it's readable.  This uses
+// epoll where we have it, so the cost of a wakeup doesn't depend on
+// the number of idle connections.
+#ifdef __linux__
+static int net_epoll_fd = -1;
+
+void
+net_watch(int fd, int id)
+{
+        if (net_epoll_fd < 0 && (net_epoll_fd = epoll_create1(0)) < 0)
+                epanic("epoll_create1 failed");
+        struct epoll_event ev = {
+                .events = EPOLLIN,
+                .data.u32 = id
+        };
+        if (epoll_ctl(net_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+                epanic("epoll_ctl failed");
+}
+
+void
+net_unwatch(int fd)
+{
+        epoll_ctl(net_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Wait up to timeout milliseconds (forever if negative) for watched
+// fds to become readable.  Store up to max of their ids in ids and
+// return how many there were.
+int
+net_wait(int *ids, int max, int timeout)
+{
+        struct epoll_event evs[64];
+        int n = epoll_wait(net_epoll_fd, evs, MIN(max, 64), timeout), i;
+        sys_calls++;
+        if (n < 0 && errno != EINTR)
+                epanic("epoll_wait failed");
+        for (i = 0; i < n; i++)
+                ids[i] = evs[i].data.u32;
+        return MAX(n, 0);
+}
+#else
+static struct pollfd *net_pollfds;
+static int *net_poll_ids, net_npoll, net_poll_cap;
+
+void
+net_watch(int fd, int id)
+{
+        if (net_npoll == net_poll_cap) {
+                net_poll_cap = net_poll_cap ? 2 * net_poll_cap : 16;
+                net_pollfds = realloc(net_pollfds,
+                                      net_poll_cap * sizeof *net_pollfds);
+                net_poll_ids = realloc(net_poll_ids,
+                                       net_poll_cap * sizeof *net_poll_ids);
+                if (!net_pollfds || !net_poll_ids)
+                        epanic("allocating poll set");
+        }
+        net_pollfds[net_npoll].fd = fd;
+        net_pollfds[net_npoll].events = POLLIN;
+        net_poll_ids[net_npoll++] = id;
+}
+
+void
+net_unwatch(int fd)
+{
+        int i;
+        for (i = 0; i < net_npoll; i++) {
+                if (net_pollfds[i].fd == fd) {
+                        net_npoll--;
+                        net_pollfds[i] = net_pollfds[net_npoll];
+                        net_poll_ids[i] = net_poll_ids[net_npoll];
+                        return;
+                }
+        }
+}
+
+int
+net_wait(int *ids, int max, int timeout)
+{
+        int n = poll(net_pollfds, net_npoll, timeout), i, count = 0;
+        sys_calls++;
+        if (n < 0 && errno != EINTR)
+                epanic("poll failed");
+        for (i = 0; i < net_npoll && count < max && n > 0; i++)
+                if (net_pollfds[i].revents)
+                        ids[count++] = net_poll_ids[i];
+        return count;
+}
+#endif
+
+/******************************************************************
+ * Dashboard
+ */
+
+// The client shows any number of servers.  Each host's stream is
+// decoded into its own delta as it arrives.  The display either shows
+// every host's CPU's, each host as its own group of bars (see
+// ui_set_groups), or drills into one host.
+
+// Entries of the by-host view are scaled to this, since each host's
+// real time differs
+#define DASH_SCALE (1 << 15)
+
+static struct dash_host
+{
+        const char *addr;
+        // The socket, or -1 once disconnected
+        int fd;
+        // Data from the server, of which len bytes haven't been
+        // decoded yet
+        unsigned char *buf;
+        size_t len, cap;
+        // The host's number of CPU's, and its current delta, once
+        // we've seen the header
+        int cpus;
+        struct cpustats *delta;
+        float load[3];
+        // Whether delta has a delta to show yet
+        bool have;
+        // Why we dropped the host, if it sent something we couldn't
+        // decode
+        const char *error;
+} *dash_hosts;
+static int dash_nhosts;
+// The host we've drilled into, or -1 for the by-host view
+static int dash_only = -1;
+// The by-host view, and the number of CPU's it and the layout copy
+// have room for.  Each host's CPU's are entries dash_groups[h] up to
+// dash_groups[h + 1] of the view, and dash_names[h] labels them.
+static struct cpustats *dash_view, *dash_layout;
+static int dash_view_cpus;
+static int *dash_groups;
+static const char **dash_names;
+
+// Start connecting to each of the n servers in addrs.
+void
+dash_init(const char **addrs, int n)
+{
+        if (!(dash_hosts = calloc(n, sizeof *dash_hosts)) ||
+            !(dash_groups = calloc(n + 1, sizeof *dash_groups)))
+                epanic("allocating hosts");
+        dash_names = addrs;
+        dash_nhosts = n;
+        play_soft = true;
+        int i;
+        for (i = 0; i < n; i++) {
+                dash_hosts[i].addr = addrs[i];
+                dash_hosts[i].fd = net_connect(addrs[i]);
+                net_watch(dash_hosts[i].fd, i);
+        }
+        if (n == 1)
+                dash_only = 0;
+}
+
+// Return the next host from h in direction dir that has something to
+// show, or h if there's none.
+int
+dash_step(int h, int dir)
+{
+        int i;
+        for (i = 1; i <= dash_nhosts; i++) {
+                int next = (h + dir * i + dash_nhosts) % dash_nhosts;
+                if (dash_hosts[next].have)
+                        return next;
+        }
+        return h;
+}
+
+// Make sure the view and layout copy have room for cpus entries.
+static void
+dash_reserve(int cpus)
+{
+        if (cpus <= dash_view_cpus)
+                return;
+        cpustats_free(dash_view);
+        cpustats_free(dash_layout);
+        dash_view = cpustats_alloc_cpus(cpus);
+        dash_layout = cpustats_alloc_cpus(cpus);
+        dash_view_cpus = cpus;
+}
+
+// Disconnect host, which sent something we can't decode, and stop
+// showing it.
+static void
+dash_drop(struct dash_host *host, const char *why)
+{
+        net_unwatch(host->fd);
+        close(host->fd);
+        host->fd = -1;
+        host->have = false;
+        host->error = why;
+}
+
+// Read what's waiting from host h and apply every complete record.
+// Return true if it has a new delta to show, or changed otherwise.
+bool
+dash_receive(int h)
+{
+        struct dash_host *host = &dash_hosts[h];
+        if (host->len == host->cap) {
+                host->cap = host->cap ? 2 * host->cap : 65536;
+                if (!(host->buf = realloc(host->buf, host->cap)))
+                        epanic("allocating receive buffer");
+        }
+        ssize_t r = read(host->fd, host->buf + host->len,
+                         host->cap - host->len);
+        sys_calls++;
+        if (r < 0 && (errno == EAGAIN || errno == EINTR))
+                return false;
+        if (r <= 0) {
+                if (!host->delta && dash_nhosts == 1)
+                        panic("%s: %s", host->addr,
+                              r ? strerror(errno) : "connection closed");
+                net_unwatch(host->fd);
+                close(host->fd);
+                host->fd = -1;
+                return true;
+        }
+        host->len += r;
+
+        // Decode every complete record.  Since deltas accumulate,
+        // only the last needs showing.
+        play_path = host->addr;
+        play_error = NULL;
+        size_t pos = 0, n;
+        bool changed = false;
+        if (!host->delta && (n = play_header_len(host->buf, host->len))) {
+                host->cpus = play_header(host->buf, n);
+                if (play_error) {
+                        dash_drop(host, play_error);
+                        return true;
+                }
+                host->delta = cpustats_alloc_cpus(host->cpus);
+                int total = 0, i;
+                for (i = 0; i < dash_nhosts; i++)
+                        total += dash_hosts[i].cpus;
+                dash_reserve(total);
+                pos = n;
+        } else if (!host->delta && host->len > 64) {
+                // Far longer than any header
+                dash_drop(host, "not a cpubars server");
+                return true;
+        }
+        // No record is longer than a delta that changes every counter
+        // of every CPU, at up to 10 bytes a varint
+        size_t most = 64 + host->cpus / 8 +
+                (host->cpus + 1) * (2 + REC_NFIELDS) * 10;
+        while (host->delta &&
+               (n = play_record_len(host->buf + pos, host->len - pos,
+                                    most))) {
+                if (n == SIZE_MAX) {
+                        dash_drop(host, "corrupt record");
+                        return true;
+                }
+                if (play_record(host->buf[pos], host->delta, host->load))
+                        host->have = changed = true;
+                if (play_error) {
+                        dash_drop(host, play_error);
+                        return true;
+                }
+                pos += n;
+        }
+        memmove(host->buf, host->buf + pos, host->len - pos);
+        host->len -= pos;
+        return changed;
+}
+
+// Return the cpustats to show, or NULL if there's nothing to show
+// yet.  load gets the load averages of the host shown, or the
+// fleet's mean.
+struct cpustats *
+dash_current(float load[3])
+{
+        int h, field, i;
+        if (dash_only >= 0) {
+                struct dash_host *host = &dash_hosts[dash_only];
+                if (!host->have)
+                        return NULL;
+                memcpy(load, host->load, sizeof host->load);
+                return host->delta;
+        }
+
+        // Each host's CPU's each take an entry, scaled by its real
+        // time.  The aggregate line is the mean of the hosts'
+        // averages, which are their aggregate lines over their real
+        // time times their number of CPU's.
+        if (!dash_view)
+                return NULL;
+        struct cpustats *out = dash_view;
+        cpustats_clear(out);
+        out->real = DASH_SCALE;
+        int shown = 0, first = 0;
+        memset(load, 0, 3 * sizeof *load);
+        for (h = 0; h < dash_nhosts; h++) {
+                const struct cpustats *in = dash_hosts[h].delta;
+                dash_groups[h] = first;
+                first += dash_hosts[h].cpus;
+                if (dash_hosts[h].fd < 0 || !dash_hosts[h].have ||
+                    !in->real || !in->online)
+                        continue;
+                unsigned long long scale = in->real * in->online;
+                for (field = 0; field < NFIELDS; field++)
+                        out->field[field][-1] +=
+                                in->field[field][-1] * DASH_SCALE / scale;
+                for (i = 0; i < dash_hosts[h].cpus; i++) {
+                        if (!cpustats_online(in, i))
+                                continue;
+                        int pos = dash_groups[h] + i;
+                        for (field = 0; field < NFIELDS; field++)
+                                out->field[field][pos] = in->field[field][i] *
+                                        DASH_SCALE / in->real;
+                        cpustats_set_online(out, pos);
+                        out->online++;
+                        out->max = pos;
+                }
+                for (i = 0; i < 3; i++)
+                        load[i] += dash_hosts[h].load[i];
+                shown++;
+        }
+        dash_groups[dash_nhosts] = first;
+        if (!out->online)
+                return NULL;
+        out->avg_capacity = 1000 * shown;
+        for (i = 0; i < 3; i++)
+                load[i] /= shown;
+        return out;
+}
+
+// Describe the current view for the status line.
+const char *
+dash_describe(void)
+{
+        static char buf[256];
+        if (dash_only >= 0) {
+                const struct dash_host *host = &dash_hosts[dash_only];
+                int len = snprintf(buf, sizeof buf, "%s", host->addr);
+                if (dash_nhosts > 1)
+                        len += snprintf(buf + len, sizeof buf - len,
+                                        " (%d of %d)", dash_only,
+                                        dash_nhosts);
+                if (host->fd < 0)
+                        snprintf(buf + len, sizeof buf - len, " (%s)",
+                                 host->error ? host->error :
+                                 "disconnected");
+                return buf;
+        }
+        int h, down = 0;
+        for (h = 0; h < dash_nhosts; h++)
+                down += dash_hosts[h].fd < 0;
+        int len = snprintf(buf, sizeof buf, "by host");
+        if (down)
+                snprintf(buf + len, sizeof buf - len,
+                         ", %d of %d disconnected", down, dash_nhosts);
+        return buf;
+}
+
+/******************************************************************
+ * Terminal
+ */
+
+static sig_atomic_t term_need_resize;
+static struct termios term_init_termios;
+static bool term_initialized;
+
+// Expanded escape sequences for setting the background and foreground
+// colors, indexed by TERM_COLOR.  The entry for the 0xff "default"
+// color resets all attributes, since that's the only portable way to
+// get back to the default colors.  Expanding these with tiparm is
+// expensive, so we do it once up front.  Colors 8 through 15 are the
+// bright versions of the basic eight.
+#define NCOLORS 16
+#define COLOR_BRIGHT(color) ((color) + 8)
+#define TERM_COLOR(color) ((color) == 0xff ? NCOLORS : (color))
+static char *term_back[NCOLORS + 1], *term_fore[NCOLORS + 1];
+// Their lengths, or -1 for those with padding, which have to go
+// through out_putp
+static int term_back_len[NCOLORS + 1], term_fore_len[NCOLORS + 1];
+// Whether cursor_address is the usual ANSI sequence, in which case
+// term_cursor_address can format it without tiparm.
+static bool term_ansi_cursor;
+
+static void
+term_on_sigwinch(int sig)
+{
+        term_need_resize = 1;
+}
+
+static void
+term_reset(void)
+{
+        if (!term_initialized)
+                return;
+        term_initialized = false;
+        // Drop any partial frame
+        out_len = 0;
+        // Leave invisible mode
+        out_putp(cursor_normal);
+        // Leave cursor mode
+        out_putp(exit_ca_mode);
+        out_flush();
+        // Reset terminal modes
+        tcsetattr(0, TCSADRAIN, &term_init_termios);
+}
+
+static char *
+term_strdup(const char *str)
+{
+        char *res = strdup(str ? str : "");
+        if (!res)
+                epanic("allocating terminal strings");
+        return res;
+}
+
+// Return the escape sequence to move the cursor to row, col.  Like
+// tiparm, the result is only valid until the next call.
+static const char *
+term_cursor_address(int row, int col)
+{
+        if (!term_ansi_cursor)
+                return tiparm(cursor_address, row, col);
+
+        // Format "\e[row;colH" back to front
+        static char buf[32];
+        char *p = buf + sizeof buf;
+        int n;
+        *--p = 0;
+        *--p = 'H';
+        n = col + 1;
+        do {
+                *--p = '0' + n % 10;
+                n /= 10;
+        } while (n);
+        *--p = ';';
+        n = row + 1;
+        do {
+                *--p = '0' + n % 10;
+                n /= 10;
+        } while (n);
+        *--p = '[';
+        *--p = '\033';
+        return p;
+}
+
+// The length of cached escape sequence str, or -1 if it has padding.
+static int
+term_cached_len(const char *str)
+{
+        if (!str)
+                return 0;
+        return strchr(str, '$') ? -1 : (int)strlen(str);
+}
+
+// (Re)build the cached escape sequences for the current terminal.
+static void
+term_cache_strings(void)
+{
+        int color;
+        for (color = 0; color <= NCOLORS; color++) {
+                free(term_back[color]);
+                free(term_fore[color]);
+                if (color == NCOLORS) {
+                        term_back[color] = term_strdup(exit_attribute_mode);
+                        term_fore[color] = term_strdup(exit_attribute_mode);
+                } else {
+                        // Terminals with only the basic colors get the
+                        // basic version of a bright color, except for
+                        // grey, which gets white rather than black
+                        int real = color;
+                        if (color >= MAX(max_colors, 8))
+                                real = color == COLOR_BRIGHT(COLOR_BLACK) ?
+                                        COLOR_WHITE : color - 8;
+                        term_back[color] =
+                                term_strdup(tiparm(set_a_background, real));
+                        term_fore[color] =
+                                term_strdup(tiparm(set_a_foreground, real));
+                }
+                term_back_len[color] = term_cached_len(term_back[color]);
+                term_fore_len[color] = term_cached_len(term_fore[color]);
+        }
+
+        // Check if we can format cursor addresses ourselves by
+        // comparing against a few tiparm results.
+        term_ansi_cursor = false;
+        if (!cursor_address)
+                return;
+        static const int probes[][2] = {{0, 0}, {9, 10}, {123, 4567}};
+        int i;
+        for (i = 0; i < sizeof probes / sizeof probes[0]; i++) {
+                char *want = term_strdup(tiparm(cursor_address, probes[i][0],
+                                                probes[i][1]));
+                term_ansi_cursor = true;
+                bool same = strcmp(want, term_cursor_address(
+                                           probes[i][0], probes[i][1])) == 0;
+                term_ansi_cursor = false;
+                free(want);
+                if (!same)
+                        return;
+        }
+        term_ansi_cursor = true;
+}
+
+void
+term_init(void)
+{
+        setupterm(NULL, 1, NULL);
+        term_cache_strings();
+        if (tcgetattr(0, &term_init_termios) < 0)
+                epanic("failed to get terminal attributes");
+
+        // Handle terminal resize
+        struct sigaction act = {
+                .sa_handler = term_on_sigwinch
+        };
+        if (sigaction(SIGWINCH, &act, NULL) < 0)
+                epanic("failed to install SIGWINCH handler");
+
+        atexit(term_reset);
+        term_initialized = true;
+
+        // Enter cursor mode
+        out_putp(enter_ca_mode);
+        // Enter invisible mode
+        out_putp(cursor_invisible);
+        // Disable echo and enter canonical (aka cbreak) mode so we
+        // get input without waiting for newline
+        struct termios tc = term_init_termios;
+        tc.c_lflag &= ~(ICANON | ECHO);
+        tc.c_iflag &= ~ICRNL;
+        tc.c_lflag |= ISIG;
+        tc.c_cc[VMIN] = 1;
+        tc.c_cc[VTIME] = 0;
+        if (tcsetattr(0, TCSAFLUSH, &tc) < 0)
+                epanic("failed to set terminal attributes");
+}
+
+// Handle any terminal resize that has happened since the last
+// `term_init' or `term_check_resize'.  Return true if there was a
+// resize.
+bool
+term_check_resize(void)
+{
+        if (!term_need_resize)
+                return false;
+
+        term_need_resize = 0;
+        // restartterm is overkill, but appears to be the only way to
+        // get ncurses to update the terminal size when using the
+        // low-level routines.
+        restartterm(NULL, 1, NULL);
+        term_cache_strings();
+        return true;
+}
+
+/******************************************************************
+ * UI
+ */
+
+static const struct ui_stat
+{
+        const char *name;
+        int color;
+        int field;
+} ui_stats[] = {
+#define FIELD(name, color) {#name, color, CPUSTAT_FIELD(name)}
+        FIELD(nice, COLOR_GREEN), FIELD(user, COLOR_BLUE),
+        FIELD(sys, COLOR_RED), FIELD(iowait, COLOR_CYAN),
+        FIELD(irq, COLOR_MAGENTA), FIELD(softirq, COLOR_YELLOW),
+        // Black and white are the default background or text on
+        // most terminals, so these take bright colors
+        FIELD(steal, COLOR_BRIGHT(COLOR_BLACK)),
+        FIELD(guest, COLOR_BRIGHT(COLOR_BLUE)),
+        // We set the color of the sentinel stat to 0xff so we can
+        // safely refer to ui_stats[NSTATS].color as the last, "idle"
+        // segment of a bar.
+        {NULL, 0xff, 0}
+#undef FIELD
+};
+#define NSTATS (sizeof(ui_stats)/sizeof(ui_stats[0]) - 1)
+
+// If we have too many bars to fit on the screen, we divide the screen
+// into "panes".  Wrapping the display into these panes is handled by
+// the final output routine.
+static struct ui_pane
+{
+        // start is the "length dimension" of the start of this pane
+        // (for vertical bars, the row, relative to the bottom).
+        // barpos is the first barpos that appears in this pane (for
+        // vertical bars, the column).  width is the size of this pane
+        // in the width dimension (for vertical bars, the number of
+        // columns).
+        int start, barpos, width;
+} *ui_panes, *ui_old_panes;
+static int ui_num_panes, ui_panes_cap, ui_old_panes_cap;
+
+static struct ui_bar
+{
+        int start, width, cpu;
+} *ui_bars;
+static int ui_num_bars, ui_bars_cap;
+
+// If ui_num_groups isn't 0, the bars are split into named groups,
+// group g being entries ui_groups[g] up to ui_groups[g + 1], and
+// ui_layout keeps each group together in a pane.
+static const int *ui_groups;
+static const char **ui_group_names;
+static int ui_num_groups;
+
+// Per-bar inputs and outputs of the cutoff computation, in
+// structure-of-arrays form so the scaling loop runs over all bars at
+// once and vectorizes.  ui_cumm and ui_cutoffs are NSTATS arrays of
+// ui_bars_cap entries each, indexed by stat * ui_bars_cap + bar.
+// ui_bar_scales is each bar's scale, and ui_recip a 32.32 fixed-point
+// reciprocal of it, split into its integer and fraction parts.
+static uint32_t *ui_cumm, *ui_cutoffs, *ui_bar_scales;
+static uint32_t *ui_recip_int, *ui_recip_frac;
+// ui_show_bars' ranking of the bars when a frame is over budget: the
+// bars in the order they get sent, and the number of changed cells
+// in each one and the bytes it takes to send them, by bar
+static int *ui_bar_order, *ui_bar_changes;
+static size_t *ui_bar_costs;
+// The cutoffs of the previous frame, if it had the same layout, so we
+// can tell how far the bars moved
+static uint32_t *ui_prev_cutoffs;
+static bool ui_prev_cutoffs_valid;
+
+// The layout of ui_display, etc is independent of final display
+// layout, hence we avoid the terms "row", "column", "x", and "y".
+// Rather, bar display is laid out as
+//
+//           len
+//           012345678 <- ui_bar_length
+//  barpos 0 |--bar--|
+//         1
+//         2 |--bar--|
+//         ^- ui_bar_width
+static int ui_bar_length, ui_bar_width;
+// Whether the CPU bars (all but the average bar) are one column wide,
+// which picks the render kernels along with ui_ascii
+static bool ui_narrow;
+// ui_display, ui_fore, and ui_back are 2-D arrays that should be
+// indexed using UIXY.  ui_display stores indexes into ui_chars.
+// ui_fore and ui_back store color codes or 0xff for default
+// attributes.
+static unsigned char *ui_display, *ui_fore, *ui_back;
+// ui_prev_display, ui_prev_fore, and ui_prev_back have the same
+// layout and record what is currently on the terminal, so we only
+// have to send the cells that changed since the last frame.
+static unsigned char *ui_prev_display, *ui_prev_fore, *ui_prev_back;
+// The allocated size of the above buffers, which only grow
+static int ui_display_cap;
+#define UIXY(array, barpos, len) (array[(barpos)*ui_bar_length + (len)])
+
+// When two changed cells are separated by at most this many unchanged
+// cells with the same attributes, it's cheaper to re-send the
+// unchanged cells than to move the cursor.
+#define UI_MAX_GAP 2
+
+#define NCHARS 8
+// After the bar characters come the peak and 95th percentile markers
+#define UI_PEAK NCHARS
+#define UI_P95 (NCHARS + 1)
+static char ui_chars[NCHARS + 2][MB_LEN_MAX] = {
+        [UI_PEAK] = "-", [UI_P95] = "."
+};
+// The length of each of ui_chars.  Cells are sent by copying all
+// MB_LEN_MAX bytes and then counting only these.
+static unsigned char ui_char_len[NCHARS + 2];
+static bool ui_ascii;
+
+// The most lines there can be above the bars.  Line 0 is the key and
+// load average, line 1 is the status line, and any lines after that
+// are for panes such as the process list.
+#define UI_MAX_TOP_LINES 16
+static int ui_top_lines = 2;
+
+// The load average and the lines below the key currently on the
+// terminal
+static char ui_load_buf[64], ui_line_bufs[UI_MAX_TOP_LINES][256];
+
+// The label rows below the bars, laid out like the bars, and the
+// labels of the previous layout.  Each is ui_label_len rows of
+// ui_bar_width characters.
+static char *ui_labels, *ui_old_labels;
+static int ui_labels_cap, ui_old_labels_cap, ui_label_len;
+// Whether the screen has been laid out yet, and the terminal size
+// when it was last cleared
+static bool ui_laid_out;
+static int ui_layout_lines, ui_layout_cols;
+
+#ifdef __STDC_ISO_10646__
+// Encode the Unicode cell characters using the system locale, or set
+// ui_ascii if it can't.
+static void
+ui_init_unicode(void)
+{
+        char *origLocale = setlocale(LC_CTYPE, NULL);
+        setlocale(LC_CTYPE, "");
+
+        int ch;
+        mbstate_t mbs;
+        memset(&mbs, 0, sizeof mbs);
+        for (ch = 1; ch < NCHARS; ch++) {
+                int len = wcrtomb(ui_chars[ch], 0x2580 + ch, &mbs);
+                if (len == -1 || !mbsinit(&mbs)) {
+                        ui_ascii = true;
+                        break;
+                }
+                ui_chars[ch][len] = 0;
+        }
+
+        // Upper one eighth block and a dashed line, if the locale has
+        // them
+        char mark[2][MB_LEN_MAX];
+        wchar_t marks[2] = {0x2594, 0x2504};
+        for (ch = 0; ch < 2 && !ui_ascii; ch++) {
+                int len = wcrtomb(mark[ch], marks[ch], &mbs);
+                if (len == -1 || !mbsinit(&mbs))
+                        break;
+                mark[ch][len] = 0;
+        }
+        if (ch == 2) {
+                strcpy(ui_chars[UI_PEAK], mark[0]);
+                strcpy(ui_chars[UI_P95], mark[1]);
+        }
+
+        // Restore the original locale
+        setlocale(LC_CTYPE, origLocale);
+}
+#endif
+
+void
+ui_init(bool force_ascii)
+{
+        // Cell character 0 is always a space, and it's the only one
+        strcpy(ui_chars[0], " ");
+
+#ifdef __STDC_ISO_10646__
+        if (force_ascii)
+                ui_ascii = true;
+        else
+                ui_init_unicode();
+#else
+        ui_ascii = true;
+#endif
+
+        int ch;
+        for (ch = 0; ch < NCHARS + 2; ch++)
+                ui_char_len[ch] = strlen(ui_chars[ch]);
+}
+
+static void
+ui_init_panes(int n)
+{
+        if (n > ui_panes_cap) {
+                free(ui_panes);
+                ui_panes_cap = n;
+                if (!(ui_panes = malloc(n * sizeof *ui_panes)))
+                        epanic("allocating panes");
+        }
+        ui_num_panes = n;
+}
+
+// Group the bars into n groups as described for ui_groups, or stop
+// grouping them if n is 0.  This takes effect at the next ui_layout.
+void
+ui_set_groups(int n, const int *groups, const char **names)
+{
+        ui_num_groups = n;
+        ui_groups = groups;
+        ui_group_names = names;
+}
+
+// Lay out the bars of cpus as one-column bars in ui_groups, each
+// group followed by a gap and at least as wide as its name.  A group
+// that doesn't fit in what's left of a pane starts the next one, and
+// one that's wider than a pane wraps across as many as it takes.
+// Return the width of the layout.
+static int
+ui_layout_groups(const struct cpustats *cpus)
+{
+        int width = MAX(COLS - 1, 1), pos = 4, end = 3, bar = 1, g, i;
+        for (g = 0; g < ui_num_groups; g++) {
+                int n = 0;
+                for (i = ui_groups[g]; i < ui_groups[g + 1]; i++)
+                        n += cpustats_online(cpus, i);
+                if (!n)
+                        continue;
+                int span = MAX(n, MIN((int)strlen(ui_group_names[g]),
+                                      width));
+                if (pos % width && pos % width + span > width)
+                        pos += width - pos % width;
+                for (i = ui_groups[g], n = 0; i < ui_groups[g + 1]; i++) {
+                        if (!cpustats_online(cpus, i))
+                                continue;
+                        ui_bars[bar].start = pos + n++;
+                        ui_bars[bar].width = 1;
+                        ui_bars[bar].cpu = i;
+                        bar++;
+                }
+                pos = end = pos + span;
+                if (pos % width)
+                        pos++;
+        }
+
+        ui_init_panes((end + width - 1) / width);
+        int plength = (LINES - ui_top_lines) / ui_num_panes;
+        for (i = 0; i < ui_num_panes; ++i) {
+                ui_panes[i].start = (ui_num_panes-i-1) * plength + 1;
+                ui_panes[i].barpos = i * width;
+                ui_panes[i].width = width;
+        }
+        ui_bar_length = MAX(0, plength - 1);
+        ui_label_len = 1;
+        return end;
+}
+
+// Grow the bar display buffers to at least size cells.  The contents
+// of the previous frame buffers are preserved.
+static void
+ui_reserve_display(int size)
+{
+        if (size <= ui_display_cap)
+                return;
+        free(ui_display);
+        free(ui_fore);
+        free(ui_back);
+        if (!(ui_display = malloc(size)))
+                epanic("allocating display buffer");
+        if (!(ui_fore = malloc(size)))
+                epanic("allocating foreground buffer");
+        if (!(ui_back = malloc(size)))
+                epanic("allocating background buffer");
+        if (!(ui_prev_display = realloc(ui_prev_display, size)) ||
+            !(ui_prev_fore = realloc(ui_prev_fore, size)) ||
+            !(ui_prev_back = realloc(ui_prev_back, size)))
+                epanic("allocating previous frame buffers");
+        ui_display_cap = size;
+}
+
+// Mark cells from start up to end as blank in the previous frame
+// buffers.
+static void
+ui_blank_prev(int start, int end)
+{
+        if (end <= start)
+                return;
+        memset(ui_prev_display + start, 0, end - start);
+        memset(ui_prev_fore + start, 0xff, end - start);
+        memset(ui_prev_back + start, 0xff, end - start);
+}
+
+// Update one row of labels on the terminal from the old label row
+// `old' of width `owidth' to the new label row `new' of width
+// `nwidth'.  Labels are drawn with default attributes.
+static void
+ui_update_label_row(int y, const char *old, int owidth,
+                    const char *new, int nwidth)
+{
+        int x = 0;
+        while (x < nwidth) {
+                if (x < owidth && old[x] == new[x]) {
+                        x++;
+                        continue;
+                }
+                // Find the end of this run of changes
+                int end = x + 1;
+                while (end < nwidth && (end >= owidth || old[end] != new[end]))
+                        end++;
+                out_putp(term_cursor_address(y, x));
+                out_write(&new[x], end - x);
+                x = end;
+        }
+
+        // Clear anything left over past the new width
+        for (; x < owidth; x++) {
+                if (old[x] != ' ') {
+                        out_putp(term_cursor_address(y, nwidth));
+                        out_putp(clr_eol);
+                        break;
+                }
+        }
+}
+
+// Clear the screen and draw the key at the top.  Anything else that
+// takes over the screen must clear ui_laid_out, so the bars are
+// redrawn from scratch afterwards.
+static void
+ui_clear(void)
+{
+        out_putp(clear_screen);
+        // Stop short of where ui_show_load usually puts the load
+        // average, so narrow terminals lose the end of the key
+        // rather than a mix of the two
+        const struct ui_stat *si;
+        int x = 0;
+        for (si = ui_stats; si->name; si++) {
+                x += 4 + strlen(si->name);
+                if (si != ui_stats && x > COLS - 23)
+                        break;
+                out_putp(term_back[si->color]);
+                out_puts("  ");
+                out_putp(exit_attribute_mode);
+                out_putc(' ');
+                out_puts(si->name);
+                out_putc(' ');
+        }
+
+        // Forget the last load average and status we showed
+        ui_load_buf[0] = 0;
+        int i;
+        for (i = 0; i < UI_MAX_TOP_LINES; i++)
+                ui_line_bufs[i][0] = 0;
+}
+
+void
+ui_layout(struct cpustats *cpus)
+{
+        int i;
+
+        // Keep the old layout around so we can update the screen
+        // incrementally if the new layout is compatible.
+        SWAP(ui_panes, ui_old_panes);
+        SWAP(ui_panes_cap, ui_old_panes_cap);
+        SWAP(ui_labels, ui_old_labels);
+        SWAP(ui_labels_cap, ui_old_labels_cap);
+        int old_num_panes = ui_num_panes, old_bar_length = ui_bar_length;
+        int old_bar_width = ui_bar_width, old_label_len = ui_label_len;
+
+        out_putp(exit_attribute_mode);
+
+        ui_prev_cutoffs_valid = false;
+
+        // Create one pane by default
+        ui_init_panes(1);
+        ui_panes[0].barpos = 0;
+
+        // Create bar info
+        ui_num_bars = cpus->online + 1;
+        if (ui_num_bars > ui_bars_cap) {
+                free(ui_bars);
+                free(ui_cumm);
+                free(ui_cutoffs);
+                free(ui_prev_cutoffs);
+                free(ui_bar_scales);
+                free(ui_bar_order);
+                free(ui_bar_changes);
+                free(ui_bar_costs);
+                free(ui_recip_int);
+                free(ui_recip_frac);
+                ui_bars_cap = ui_num_bars;
+                if (!(ui_bars = malloc(ui_num_bars * sizeof *ui_bars)) ||
+                    !(ui_cumm = malloc(NSTATS * ui_num_bars * sizeof *ui_cumm)) ||
+                    !(ui_cutoffs = malloc(NSTATS * ui_num_bars *
+                                          sizeof *ui_cutoffs)) ||
+                    !(ui_prev_cutoffs = malloc(NSTATS * ui_num_bars *
+                                               sizeof *ui_prev_cutoffs)) ||
+                    !(ui_bar_scales = malloc(ui_num_bars *
+                                             sizeof *ui_bar_scales)) ||
+                    !(ui_bar_order = malloc(ui_num_bars *
+                                            sizeof *ui_bar_order)) ||
+                    !(ui_bar_changes = malloc(ui_num_bars *
+                                              sizeof *ui_bar_changes)) ||
+                    !(ui_bar_costs = malloc(ui_num_bars *
+                                            sizeof *ui_bar_costs)) ||
+                    !(ui_recip_int = malloc(ui_num_bars *
+                                            sizeof *ui_recip_int)) ||
+                    !(ui_recip_frac = malloc(ui_num_bars *
+                                             sizeof *ui_recip_frac)))
+                        epanic("allocating bars");
+        }
+
+        // Create average bar
+        ui_bars[0].start = 0;
+        ui_bars[0].width = 3;
+        ui_bars[0].cpu = -1;
+
+        // Lay out labels
+        char buf[16];
+        snprintf(buf, sizeof buf, "%d", cpus->max);
+        int length = strlen(buf);
+        int w = COLS - 4, end = 0;
+
+        if (ui_num_groups) {
+                end = ui_layout_groups(cpus);
+        } else if ((length + 1) * cpus->online < w) {
+                // Lay out the labels horizontally
+                ui_panes[0].start = 1;
+                ui_bar_length = MAX(0, LINES - ui_panes[0].start -
+                                    ui_top_lines);
+                ui_label_len = 1;
+                int bar = 1;
+                FOR_EACH_ONLINE(i, cpus) {
+                        ui_bars[bar].start = 4 + (bar-1)*(length+1);
+                        ui_bars[bar].width = length;
+                        ui_bars[bar].cpu = i;
+                        bar++;
+                }
+        } else {
+                // Lay out the labels vertically
+                int pad = 0;
+                ui_panes[0].start = length;
+                ui_bar_length = MAX(0, LINES - ui_panes[0].start -
+                                    ui_top_lines);
+                ui_label_len = length;
+
+                if (cpus->online * 2 < w) {
+                        // We have space for padding
+                        pad = 1;
+                } else if (cpus->online >= w && COLS >= 2) {
+                        // We don't have space for all of them
+                        int totalw = 4 + cpus->online;
+                        ui_init_panes((totalw + COLS - 2) / (COLS - 1));
+                        int plength = (LINES - ui_top_lines) / ui_num_panes;
+                        for (i = 0; i < ui_num_panes; ++i) {
+                                ui_panes[i].start =
+                                        (ui_num_panes-i-1) * plength + length;
+                                ui_panes[i].barpos = i * (COLS - 1);
+                                ui_panes[i].width = COLS - 1;
+                        }
+                        ui_bar_length = MAX(0, plength - length);
+                }
+
+                int bar = 1;
+                FOR_EACH_ONLINE(i, cpus) {
+                        ui_bars[bar].start = 4 + (bar-1)*(pad+1);
+                        ui_bars[bar].width = 1;
+                        ui_bars[bar].cpu = i;
+                        bar++;
+                }
+        }
+        ui_bar_width = MAX(end, ui_bars[ui_num_bars-1].start +
+                           ui_bars[ui_num_bars-1].width);
+        ui_narrow = ui_num_bars == 1 || ui_bars[1].width == 1;
+
+        // Trim down the last pane to the right width
+        ui_panes[ui_num_panes - 1].width =
+                ui_bar_width - ui_panes[ui_num_panes - 1].barpos;
+
+        // If the terminal size, the bar length, and the pane
+        // positions are unchanged, every cell we've already drawn is
+        // still where the new layout expects it, so we can update
+        // the screen incrementally.  This is the common case when
+        // CPU's come and go.  Otherwise, start from a clear screen.
+        bool full = !ui_laid_out || LINES != ui_layout_lines ||
+                COLS != ui_layout_cols || ui_bar_length != old_bar_length ||
+                ui_label_len != old_label_len || ui_num_panes != old_num_panes;
+        for (i = 0; !full && i < ui_num_panes; i++)
+                if (ui_panes[i].start != ui_old_panes[i].start ||
+                    ui_panes[i].barpos != ui_old_panes[i].barpos)
+                        full = true;
+
+        // Allocate bar display buffers
+        int size = ui_bar_length * ui_bar_width;
+        ui_reserve_display(MAX(size, 1));
+
+        if (full) {
+                ui_clear();
+                ui_laid_out = true;
+                ui_layout_lines = LINES;
+                ui_layout_cols = COLS;
+
+                // We just cleared the screen, so every cell is blank
+                ui_blank_prev(0, size);
+        } else if (ui_bar_width > old_bar_width) {
+                // The new bar positions are blank on the screen
+                ui_blank_prev(old_bar_length * old_bar_width, size);
+        } else if (ui_bar_width < old_bar_width) {
+                // Clear the bar positions that are no longer used.
+                // Since the pane positions didn't change, these are
+                // all at the end of the last pane.
+                struct ui_pane *pane = &ui_panes[ui_num_panes - 1];
+                int row;
+                for (row = 0; row < ui_bar_length; row++) {
+                        out_putp(term_cursor_address(
+                                         LINES - pane->start - row - 1,
+                                         pane->width));
+                        out_putp(clr_eol);
+                }
+        }
+
+        if (ui_ascii) {
+                // ui_display and ui_fore don't change in ASCII mode
+                memset(ui_display, 0, size);
+                memset(ui_fore, 0xff, size);
+        }
+
+        // Lay out labels
+        int label_size = ui_bar_width * ui_label_len;
+        if (label_size > ui_labels_cap) {
+                free(ui_labels);
+                ui_labels_cap = label_size;
+                if (!(ui_labels = malloc(label_size)))
+                        epanic("allocating label buffer");
+        }
+        memset(ui_labels, ' ', label_size);
+        // Grouped bars only have their group's name under the first
+        int bar, g;
+        for (bar = 0; bar < (ui_num_groups ? 1 : ui_num_bars); ++bar) {
+                char *out = &ui_labels[ui_bars[bar].start];
+                int len;
+                if (bar == 0) {
+                        strcpy(buf, "avg");
+                        len = 3;
+                } else
+                        len = snprintf(buf, sizeof buf, "%d", ui_bars[bar].cpu);
+                if (ui_label_len == 1 || bar == 0)
+                        memcpy(out, buf, len);
+                else
+                        for (i = 0; i < len; i++)
+                                out[i * ui_bar_width] = buf[i];
+        }
+        for (bar = 1, g = 0; ui_num_groups && bar < ui_num_bars; bar++) {
+                if (bar > 1 && ui_bars[bar].cpu < ui_groups[g + 1])
+                        continue;
+                while (ui_bars[bar].cpu >= ui_groups[g + 1])
+                        g++;
+                int start = ui_bars[bar].start;
+                memcpy(&ui_labels[start], ui_group_names[g],
+                       MIN((int)strlen(ui_group_names[g]),
+                           ui_bar_width - start));
+        }
+
+        // Draw labels
+        for (i = 0; i < ui_num_panes; ++i) {
+                struct ui_pane *pane = &ui_panes[i];
+                int row;
+                if (full) {
+                        out_putp(term_cursor_address(LINES - pane->start, 0));
+                        for (row = 0; row < ui_label_len; ++row) {
+                                if (row > 0)
+                                        out_putc('\n');
+                                out_write(&ui_labels[row*ui_bar_width +
+                                                     pane->barpos],
+                                          pane->width);
+                        }
+                        continue;
+                }
+                for (row = 0; row < ui_label_len; ++row)
+                        ui_update_label_row(
+                                LINES - pane->start + row,
+                                &ui_old_labels[row*old_bar_width +
+                                               pane->barpos],
+                                ui_old_panes[i].width,
+                                &ui_labels[row*ui_bar_width + pane->barpos],
+                                pane->width);
+        }
+}
+
+void
+ui_show_load(float load[3])
+{
+        char buf[sizeof ui_load_buf];
+        int pos;
+        snprintf(buf, sizeof buf, "%0.2f %0.2f %0.2f",
+                 load[0], load[1], load[2]);
+        if (strcmp(buf, ui_load_buf) == 0)
+                return;
+        strcpy(ui_load_buf, buf);
+        pos = COLS - strlen(buf) - 8;
+        if (pos < 0)
+                pos = 0;
+        out_putp(term_cursor_address(0, pos));
+        out_putp(exit_attribute_mode);
+        out_putp(term_fore[COLOR_WHITE]);
+        out_puts("  load: ");
+        out_putp(exit_attribute_mode);
+        out_puts(buf);
+}
+
+// Show msg on line y of the lines below the key, if it isn't there
+// already.
+void
+ui_show_line(int y, const char *msg)
+{
+        char *buf = ui_line_bufs[y];
+        if (strcmp(msg, buf) == 0)
+                return;
+        snprintf(buf, MIN((int)sizeof ui_line_bufs[y], MAX(COLS, 1)),
+                 "%s", msg);
+        out_putp(term_cursor_address(y, 0));
+        out_putp(exit_attribute_mode);
+        out_puts(buf);
+        out_putp(clr_eol);
+}
+
+// Show a status message on the otherwise empty line below the key.
+void
+ui_show_status(const char *msg)
+{
+        ui_show_line(1, msg);
+}
+
+// Return the 32.32 fixed-point reciprocal ui_scale_cutoffs uses for
+// scale, times total.  Rounding it up means the scaled cutoff is
+// never below the exact quotient, and at most one above it.
+static inline uint64_t
+ui_recip(uint64_t total, uint32_t scale)
+{
+        return scale ? ((total << 32) + scale - 1) / scale : 0;
+}
+
+// Compute out[i] = cumm[i] * total / scale[i] for n bars, where recip
+// is ui_recip split into rint and rfrac.  The multiply by the
+// reciprocal can come out one too high once scale reaches 2^16, so
+// it steps back when q times the scale overshoots, which keeps the
+// result exact for any 32-bit scale.  This takes only 32x32->64 bit
+// multiplies, which every SIMD instruction set has, and the loop
+// vectorizes.
+#if !defined(CPUBARS_SCALAR) || defined(CPUBARS_BENCH)
+static void
+ui_scale_cutoffs(uint32_t *restrict out, const uint32_t *restrict cumm,
+                 const uint32_t *restrict scale,
+                 const uint32_t *restrict rint,
+                 const uint32_t *restrict rfrac, uint32_t total, int n)
+{
+        int i;
+        for (i = 0; i < n; i++) {
+                uint32_t q = cumm[i] * rint[i] +
+                        (uint32_t)(((uint64_t)cumm[i] * rfrac[i]) >> 32);
+                // q is one too high if the remainder is negative
+                out[i] = q - (uint32_t)(((uint64_t)cumm[i] * total -
+                                         (uint64_t)q * scale[i]) >> 63);
+        }
+}
+#endif
+
+#if defined(CPUBARS_SCALAR) || defined(CPUBARS_BENCH)
+// The scaling ui_scale_cutoffs replaced, which divides each cutoff by
+// its bar's scale.  Building with -DCPUBARS_SCALAR uses this instead,
+// so the benchmark can compare the two, and -c checks that they
+// agree.
+static void
+ui_scale_cutoffs_scalar(uint32_t *restrict out, const uint32_t *restrict cumm,
+                        const uint32_t *restrict scale, uint32_t total, int n)
+{
+        int i;
+        for (i = 0; i < n; i++)
+                out[i] = scale[i] ?
+                        (uint64_t)cumm[i] * total / scale[i] : 0;
+}
+#endif
+
+// Return the scale of cpu's counters in delta, which run from 0 to
+// it.  For per-CPU bars this is just the real time, but for the
+// average bar, it's multiplied by the number of online CPU's (or the
+// capacity, if there is one), and likewise for aggregated bars.
+static uint64_t
+ui_scale(const struct cpustats *delta, int cpu)
+{
+        uint64_t scale = delta->real;
+        if (cpu == -1 && delta->avg_capacity)
+                scale = scale * delta->avg_capacity / 1000;
+        else if (cpu == -1)
+                scale *= delta->weight ? delta->avg_weight : delta->online;
+        else if (delta->weight)
+                scale *= delta->weight[cpu];
+        return scale;
+}
+
+// Put marker char in bar barpos at the level of cpu's entry in
+// levels, if that's above the top of the bar.
+static void
+ui_mark(int barpos, int cpu, const uint8_t *levels, int marker)
+{
+        if (!levels[cpu])
+                return;
+        int len = MIN(levels[cpu] * ui_bar_length / CPUSTATS_PEAK_SCALE,
+                      ui_bar_length - 1);
+        if (UIXY(ui_back, barpos, len) != 0xff ||
+            UIXY(ui_display, barpos, len) != 0)
+                return;
+        UIXY(ui_display, barpos, len) = marker;
+        UIXY(ui_fore, barpos, len) = 0xff;
+}
+
+// The number of steps we divide each display cell into, so the
+// cutoffs between segments can use integer math
+#define UI_SUBCELLS 256
+
+// Gather the cumulative values of bar, whose counters run from 0 to
+// scale, and its reciprocal.
+static inline void
+ui_gather_bar(const struct cpustats *delta, int bar, uint64_t scale)
+{
+        int cpu = ui_bars[bar].cpu, i;
+
+        // Scales past 32 bits (which take hours of ticks on thousands
+        // of CPU's) drop their low bits, and so do the values.
+        int shift = 0;
+        while (scale >> shift > UINT32_MAX)
+                shift++;
+        scale >>= shift;
+        ui_bar_scales[bar] = scale;
+
+        // Clamp the values to the scale so they fit the fixed-point
+        // multiply.  An empty scale gives an empty bar.
+        uint64_t cumm = 0;
+        for (i = 0; i < NSTATS; i++) {
+                cumm += delta->field[ui_stats[i].field][cpu];
+                ui_cumm[i * ui_bars_cap + bar] = MIN(cumm >> shift, scale);
+        }
+
+#ifndef CPUBARS_SCALAR
+        uint64_t recip = ui_recip((uint64_t)ui_bar_length * UI_SUBCELLS,
+                                  scale);
+        ui_recip_int[bar] = recip >> 32;
+        ui_recip_frac[bar] = recip;
+#endif
+}
+
+// Construct the cells of bar from its cutoffs.  ascii and narrow are
+// constants in every caller (see ui_compute_kernels), so each
+// instance only has the code for its own mode.  narrow means the bar
+// is one column wide.
+static inline __attribute__((always_inline)) void
+ui_build_bar(const struct cpustats *delta, int bar, const bool ascii,
+             const bool narrow)
+{
+        const int total = ui_bar_length * UI_SUBCELLS;
+        int barpos = ui_bars[bar].start, i;
+        unsigned char *back = &UIXY(ui_back, barpos, 0);
+        unsigned char *display = &UIXY(ui_display, barpos, 0);
+        unsigned char *fore = &UIXY(ui_fore, barpos, 0);
+
+        // To simplify the code, we include one additional cutoff
+        // fixed at the very top of the bar so we can treat the empty
+        // region above the bar as a segment.
+        int cutoff[NSTATS + 1];
+        for (i = 0; i < NSTATS; i++)
+                cutoff[i] = ui_cutoffs[i * ui_bars_cap + bar];
+        cutoff[NSTATS] = total;
+
+        int len, stat;
+        for (len = stat = 0; len < ui_bar_length && stat < NSTATS; len++) {
+                int lo = len * UI_SUBCELLS, hi = lo + UI_SUBCELLS;
+                if (cutoff[stat] >= hi) {
+                        // Cell is entirely covered
+                        back[len] = ui_stats[stat].color;
+                        continue;
+                }
+
+                // Find the two segments the cover this cell the most
+                int topStat[2] = {0, 0};
+                int topVal[2] = {-1, -1};
+                int val, prev = lo;
+                for (; stat < NSTATS + 1; stat++) {
+                        val = MIN(cutoff[stat], hi) - prev;
+                        prev = cutoff[stat];
+                        if (val > topVal[0]) {
+                                topStat[1] = topStat[0];
+                                topVal[1] = topVal[0];
+                                topStat[0] = stat;
+                                topVal[0] = val;
+                        } else if (val > topVal[1]) {
+                                topStat[1] = stat;
+                                topVal[1] = val;
+                        }
+                        if (cutoff[stat] >= hi)
+                                break;
+                }
+                if (topVal[0] == -1 || topVal[1] == -1)
+                        panic("bug: topVal={%d,%d}", topVal[0], topVal[1]);
+
+                if (ascii) {
+                        // We only care about the biggest cover
+                        back[len] = ui_stats[topStat[0]].color;
+                        continue;
+                }
+
+                // Order the segments by stat so we put the earlier
+                // stat on the bottom
+                if (topStat[0] > topStat[1]) {
+                        SWAP(topStat[0], topStat[1]);
+                        SWAP(topVal[0], topVal[1]);
+                }
+
+                // Re-scale and choose a split
+                int cell = topVal[0] * NCHARS / (topVal[0] + topVal[1]);
+
+                // Fill the cell
+                if (cell == NCHARS - 1) {
+                        // We leave this as a space, which means the
+                        // color roles are reversed
+                        back[len] = ui_stats[topStat[0]].color;
+                } else {
+                        display[len] = cell;
+                        fore[len] = ui_stats[topStat[0]].color;
+                        back[len] = ui_stats[topStat[1]].color;
+                }
+        }
+
+        if (delta->peak) {
+                ui_mark(barpos, ui_bars[bar].cpu, delta->peak, UI_PEAK);
+                ui_mark(barpos, ui_bars[bar].cpu, delta->p95, UI_P95);
+        }
+
+        // Copy across bar length
+        if (narrow)
+                return;
+        for (i = 1; i < ui_bars[bar].width; ++i) {
+                memcpy(&UIXY(ui_display, barpos+i, 0), display, ui_bar_length);
+                memcpy(&UIXY(ui_fore, barpos+i, 0), fore, ui_bar_length);
+                memcpy(&UIXY(ui_back, barpos+i, 0), back, ui_bar_length);
+        }
+}
+
+// Whether the last frame had peak markers
+static bool ui_marked;
+
+// ui_compute_bars for one render mode.  This is instantiated by
+// ui_compute_kernels for ASCII or Unicode, and for CPU bars that are
+// one column wide or several.
+static inline __attribute__((always_inline)) int
+ui_compute_kernel(struct cpustats *delta, const bool ascii, const bool narrow)
+{
+        size_t size = ui_bar_length * ui_bar_width;
+        if (!ascii) {
+                // ui_display and ui_fore are only used in Unicode mode
+                memset(ui_display, 0, size);
+                memset(ui_fore, 0xff, size);
+        } else if (ui_marked) {
+                // Except for markers, which use the default colors
+                memset(ui_display, 0, size);
+        }
+        ui_marked = delta->peak;
+        memset(ui_back, 0xff, size);
+
+        // Calculate cut-offs between segments.  The average bar is
+        // always bar 0, so only it needs ui_scale.
+        int i, bar;
+        ui_gather_bar(delta, 0, ui_scale(delta, -1));
+        if (delta->weight) {
+                for (bar = 1; bar < ui_num_bars; bar++)
+                        ui_gather_bar(delta, bar, delta->real *
+                                      delta->weight[ui_bars[bar].cpu]);
+        } else {
+                for (bar = 1; bar < ui_num_bars; bar++)
+                        ui_gather_bar(delta, bar, delta->real);
+        }
+
+        // Scale all of the cutoffs
+        SWAP(ui_cutoffs, ui_prev_cutoffs);
+        const uint32_t total = ui_bar_length * UI_SUBCELLS;
+        for (i = 0; i < NSTATS; i++) {
+#ifdef CPUBARS_SCALAR
+                ui_scale_cutoffs_scalar(&ui_cutoffs[i * ui_bars_cap],
+                                        &ui_cumm[i * ui_bars_cap],
+                                        ui_bar_scales, total, ui_num_bars);
+#else
+                ui_scale_cutoffs(&ui_cutoffs[i * ui_bars_cap],
+                                 &ui_cumm[i * ui_bars_cap], ui_bar_scales,
+                                 ui_recip_int, ui_recip_frac, total,
+                                 ui_num_bars);
+#endif
+        }
+
+        // Compare them to the last frame's
+        int moved = INT_MAX;
+        if (ui_prev_cutoffs_valid) {
+                uint32_t most = 0;
+                for (i = 0; i < NSTATS; i++) {
+                        const uint32_t *cur = &ui_cutoffs[i * ui_bars_cap];
+                        const uint32_t *prev = &ui_prev_cutoffs[i * ui_bars_cap];
+                        for (bar = 0; bar < ui_num_bars; bar++)
+                                most = MAX(most, cur[bar] > prev[bar] ?
+                                           cur[bar] - prev[bar] :
+                                           prev[bar] - cur[bar]);
+                }
+                moved = most / UI_SUBCELLS;
+        }
+        ui_prev_cutoffs_valid = true;
+
+        // The average bar is always three columns wide
+        ui_build_bar(delta, 0, ascii, false);
+        for (bar = 1; bar < ui_num_bars; bar++)
+                ui_build_bar(delta, bar, ascii, narrow);
+        return moved;
+}
+
+static int
+ui_compute_unicode(struct cpustats *delta)
+{
+        return ui_compute_kernel(delta, false, false);
+}
+
+static int
+ui_compute_unicode_narrow(struct cpustats *delta)
+{
+        return ui_compute_kernel(delta, false, true);
+}
+
+static int
+ui_compute_ascii(struct cpustats *delta)
+{
+        return ui_compute_kernel(delta, true, false);
+}
+
+static int
+ui_compute_ascii_narrow(struct cpustats *delta)
+{
+        return ui_compute_kernel(delta, true, true);
+}
+
+// The instances of ui_compute_kernel, indexed by ui_ascii and
+// ui_narrow
+static int (*const ui_compute_kernels[2][2])(struct cpustats *) = {
+        {ui_compute_unicode, ui_compute_unicode_narrow},
+        {ui_compute_ascii, ui_compute_ascii_narrow},
+};
+
+// Compute the bars for delta.  Returns how far the furthest moving
+// segment boundary moved since the last call, in cells, or INT_MAX
+// if the layout changed since then.
+int
+ui_compute_bars(struct cpustats *delta)
+{
+        return ui_compute_kernels[ui_ascii][ui_narrow](delta);
+}
+
+// Send the cached string for color from strs, term_back or
+// term_fore.
+static inline void
+ui_put_attr(char *const strs[], int color)
+{
+        const int *lens = strs == term_back ? term_back_len : term_fore_len;
+        int len = lens[TERM_COLOR(color)];
+        if (len < 0)
+                out_putp(strs[TERM_COLOR(color)]);
+        else
+                out_write(strs[TERM_COLOR(color)], len);
+}
+
+// Test if a cell on the terminal already shows what it should show.
+// In ASCII mode, the foreground is always the default.
+static inline __attribute__((always_inline)) bool
+ui_cell_current(int col, int row, const bool ascii)
+{
+        int cell = UIXY(ui_display, col, row);
+        if (cell != UIXY(ui_prev_display, col, row) ||
+            UIXY(ui_back, col, row) != UIXY(ui_prev_back, col, row))
+                return false;
+        // If it's a space, we don't care what the foreground color is.
+        return ascii || cell == 0 ||
+                UIXY(ui_fore, col, row) == UIXY(ui_prev_fore, col, row);
+}
+
+static void
+ui_set_attrs(int back, int fore, int *lastBack, int *lastFore)
+{
+        if (*lastBack == back && *lastFore == fore)
+                return;
+        if (back == 0xff || fore == 0xff) {
+                ui_put_attr(term_back, 0xff);
+                *lastBack = *lastFore = 0xff;
+        }
+        if (*lastBack != back) {
+                ui_put_attr(term_back, back);
+                *lastBack = back;
+        }
+        if (*lastFore != fore) {
+                ui_put_attr(term_fore, fore);
+                *lastFore = fore;
+        }
+}
+
+static inline __attribute__((always_inline)) void
+ui_put_cell(int col, int row, int *lastBack, int *lastFore, const bool ascii)
+{
+        int cell = UIXY(ui_display, col, row);
+        int back = UIXY(ui_back, col, row);
+        int fore = UIXY(ui_fore, col, row);
+
+        // If it's a space, we don't care what the foreground color is.
+        if (cell == 0 && *lastFore != -1)
+                fore = *lastFore;
+
+        if (back != *lastBack || fore != *lastFore)
+                ui_set_attrs(back, fore, lastBack, lastFore);
+        out_reserve(MB_LEN_MAX);
+        if (ascii) {
+                out_buf[out_len++] = ui_chars[cell][0];
+        } else {
+                memcpy(out_buf + out_len, ui_chars[cell], MB_LEN_MAX);
+                out_len += ui_char_len[cell];
+        }
+}
+
+// Test if it's cheaper to re-send the unchanged cells from cursor up
+// to col than to move the cursor.  This is only the case for short
+// gaps that don't require changing attributes.
+static inline __attribute__((always_inline)) bool
+ui_gap_cheap(int cursor, int col, int row, int lastBack, int lastFore,
+             const bool ascii)
+{
+        if (cursor == -1 || col - cursor > UI_MAX_GAP)
                 return false;
+        for (; cursor < col; cursor++) {
+                int cell = UIXY(ui_display, cursor, row);
+                if (UIXY(ui_back, cursor, row) != lastBack ||
+                    (cell != 0 && !ascii &&
+                     UIXY(ui_fore, cursor, row) != lastFore))
+                        return false;
+        }
+        return true;
+}
+
+// ui_show_pane for ASCII or Unicode, like ui_compute_kernel.
+static inline __attribute__((always_inline)) void
+ui_show_kernel(struct ui_pane *pane, const bool ascii)
+{
+        int row, col;
+        int lastBack = -1, lastFore = -1;
+        for (row = 0; row < ui_bar_length; row++) {
+                int y = LINES - pane->start - row - 1;
+
+                // What's the width of this row?  Beyond this, we can
+                // just clear the line.
+                int endCol = 0;
+                for (col = pane->barpos; col < pane->barpos + pane->width;
+                     col++) {
+                        if (UIXY(ui_back, col, row) != 0xff ||
+                            UIXY(ui_display, col, row) != 0)
+                                endCol = col + 1;
+                }
+
+                // Send only the cells that changed.  cursor tracks
+                // the column the terminal cursor is in, or -1 if it's
+                // not on this row.
+                int cursor = -1;
+                for (col = pane->barpos; col < pane->barpos + pane->width;
+                     col++) {
+                        if (ui_cell_current(col, row, ascii))
+                                continue;
+
+                        // Get the cursor to this cell
+                        if (ui_gap_cheap(cursor, col, row,
+                                         lastBack, lastFore, ascii)) {
+                                for (; cursor < col; cursor++)
+                                        ui_put_cell(cursor, row, &lastBack,
+                                                    &lastFore, ascii);
+                        } else if (cursor != col) {
+                                out_putp(term_cursor_address(
+                                                 y, col - pane->barpos));
+                        }
+
+                        if (col >= endCol) {
+                                // The rest of this row is blank
+                                ui_set_attrs(0xff, 0xff,
+                                             &lastBack, &lastFore);
+                                out_putp(clr_eol);
+                                break;
+                        }
+
+                        ui_put_cell(col, row, &lastBack, &lastFore, ascii);
+                        cursor = col + 1;
+                }
+        }
+}
+
+static void
+ui_show_pane_unicode(struct ui_pane *pane)
+{
+        ui_show_kernel(pane, false);
+}
+
+static void
+ui_show_pane_ascii(struct ui_pane *pane)
+{
+        ui_show_kernel(pane, true);
+}
+
+static void
+ui_show_panes(void)
+{
+        void (*show)(struct ui_pane *) =
+                ui_ascii ? ui_show_pane_ascii : ui_show_pane_unicode;
+        int pane;
+        for (pane = 0; pane < ui_num_panes; ++pane)
+                show(&ui_panes[pane]);
+}
+
+// The full frame while ui_show_bars tries sending only part of it,
+// as one buffer of ui_display, ui_fore, and ui_back
+static unsigned char *ui_full_frame;
+static int ui_full_frame_cap;
+// How many times ui_show_bars renders a frame with fewer bars when
+// the bars it picked come out over budget, before it sends none
+#define UI_FIT_TRIES 3
+
+// Make bar look unchanged by taking its cells from the previous frame.
+static void
+ui_hold_bar(int bar)
+{
+        int start = ui_bars[bar].start * ui_bar_length;
+        int len = ui_bars[bar].width * ui_bar_length;
+        memcpy(ui_display + start, ui_prev_display + start, len);
+        memcpy(ui_fore + start, ui_prev_fore + start, len);
+        memcpy(ui_back + start, ui_prev_back + start, len);
+}
+
+// Output the full frame, less the bars order[n] and on.
+static void
+ui_show_some_bars(const int *order, int n)
+{
+        int size = ui_bar_length * ui_bar_width, i;
+        memcpy(ui_display, ui_full_frame, size);
+        memcpy(ui_fore, ui_full_frame + size, size);
+        memcpy(ui_back, ui_full_frame + 2 * size, size);
+        for (i = n; i < ui_num_bars; i++)
+                ui_hold_bar(order[i]);
+        ui_show_panes();
+}
+
+// Count the cells of bar that changed, and return how many bytes it
+// takes to send them on their own: a cursor move to each run of
+// them, then the cells with their attributes.  This renders the bar
+// into out_buf and takes it back out.
+static size_t
+ui_bar_cost(int bar, int *changes)
+{
+        const struct ui_bar *b = &ui_bars[bar];
+        const struct ui_pane *pane = ui_panes;
+        while (pane < ui_panes + ui_num_panes - 1 &&
+               b->start >= pane->barpos + pane->width)
+                pane++;
 
-        int i;
-        for (i = 0; i < a->max; i++)
-                if (a->cpus[i].online != b->cpus[i].online)
-                        return false;
-        return true;
+        size_t start = out_len;
+        int row, col;
+        *changes = 0;
+        for (row = 0; row < ui_bar_length; row++) {
+                int y = LINES - pane->start - row - 1, cursor = -1;
+                int lastBack = -1, lastFore = -1;
+                for (col = b->start; col < b->start + b->width; col++) {
+                        if (ui_cell_current(col, row, ui_ascii))
+                                continue;
+                        if (cursor != col)
+                                out_putp(term_cursor_address(
+                                                 y, col - pane->barpos));
+                        ui_put_cell(col, row, &lastBack, &lastFore,
+                                    ui_ascii);
+                        cursor = col + 1;
+                        ++*changes;
+                }
+        }
+        size_t cost = out_len - start;
+        out_len = start;
+        return cost;
+}
+
+static int
+ui_compare_changes(const void *a, const void *b)
+{
+        int ca = ui_bar_changes[*(const int *)a];
+        int cb = ui_bar_changes[*(const int *)b];
+        return (cb > ca) - (cb < ca);
+}
+
+// Output the bars, in at most budget bytes if possible.  If the whole
+// update doesn't fit, this sends only the average bar and the bars
+// that changed the most, as many as fit; the rest stay as they are on
+// the terminal and catch up in later frames.
+void
+ui_show_bars(size_t budget)
+{
+        size_t start = out_len;
+        ui_show_panes();
+        if (out_len - start > budget) {
+                int size = ui_bar_length * ui_bar_width, bar;
+                if (3 * size > ui_full_frame_cap) {
+                        free(ui_full_frame);
+                        ui_full_frame_cap = 3 * size;
+                        if (!(ui_full_frame = malloc(3 * size)))
+                                epanic("allocating frame copy");
+                }
+                memcpy(ui_full_frame, ui_display, size);
+                memcpy(ui_full_frame + size, ui_fore, size);
+                memcpy(ui_full_frame + 2 * size, ui_back, size);
+
+                // Rank the bars by how many of their cells changed,
+                // with the average bar first no matter what
+                out_len = start;
+                for (bar = 0; bar < ui_num_bars; bar++) {
+                        ui_bar_costs[bar] = ui_bar_cost(bar,
+                                                        &ui_bar_changes[bar]);
+                        if (bar == 0)
+                                ui_bar_changes[bar] = INT_MAX;
+                        ui_bar_order[bar] = bar;
+                }
+                qsort(ui_bar_order, ui_num_bars, sizeof *ui_bar_order,
+                      ui_compare_changes);
+
+                // Take as many as fit by their costs.  Together they
+                // share cursor moves and attributes, so they mostly
+                // come out cheaper than that, but if not, cut back in
+                // proportion to the overshoot.
+                size_t total = 0;
+                int n = 0, tries;
+                while (n < ui_num_bars &&
+                       total + ui_bar_costs[ui_bar_order[n]] <= budget)
+                        total += ui_bar_costs[ui_bar_order[n++]];
+                for (tries = 0; ; tries++) {
+                        out_len = start;
+                        ui_show_some_bars(ui_bar_order, n);
+                        size_t len = out_len - start;
+                        if (len <= budget || n == 0)
+                                break;
+                        if (tries == UI_FIT_TRIES) {
+                                out_len = start;
+                                ui_show_some_bars(ui_bar_order, 0);
+                                break;
+                        }
+                        n = MIN(n - 1, (int)((uint64_t)n * budget / len));
+                }
+        }
+
+        // The terminal is now up to date
+        memcpy(ui_prev_display, ui_display, ui_bar_length * ui_bar_width);
+        memcpy(ui_prev_fore, ui_fore, ui_bar_length * ui_bar_width);
+        memcpy(ui_prev_back, ui_back, ui_bar_length * ui_bar_width);
 }
 
 /******************************************************************
- * Terminal
+ * History
  */
 
-static sig_atomic_t term_need_resize;
-static struct termios term_init_termios;
-static bool term_initialized;
+// The history view is a strip chart with one row per bar and one
+// column per sample, newest on the right.  Samples are kept as the
+// cells they're drawn as, in a ring buffer sized once from the
+// terminal size at startup, so memory is bounded and adding a sample
+// never allocates.  Each new sample scrolls the rows left by deleting
+// a character at the start of the chart, so only the new column has
+// to be drawn.
 
-static void
-term_on_sigwinch(int sig)
+// The most rows and columns we keep, fixed by hist_init
+static int hist_rows_cap, hist_cols_cap;
+// hist_rows_cap rows of hist_cols_cap samples each.  A sample is its
+// height in eighths of a cell in the low 4 bits and the index of its
+// biggest stat above that.
+static unsigned char *hist_ring;
+// The column the next sample goes in, and how many are filled
+static int hist_pos, hist_len;
+// The entry each row shows (-1 for the average), and the number of
+// rows
+static int *hist_cpus, hist_nrows;
+// What's on the screen, if the history is showing: the label width,
+// the chart width, the number of rows, and the number of samples
+// added since
+static bool hist_shown;
+static int hist_label_len, hist_width, hist_shown_rows, hist_unshown;
+static int hist_shown_top;
+
+void
+hist_init(void)
 {
-        term_need_resize = 1;
+        hist_rows_cap = MAX(LINES - 2, 1);
+        hist_cols_cap = MAX(COLS, 1);
+        if (!(hist_ring = calloc(hist_rows_cap, hist_cols_cap)) ||
+            !(hist_cpus = malloc(hist_rows_cap * sizeof *hist_cpus)))
+                epanic("allocating history");
+}
+
+#define HIST_SAMPLE(row, age)                                           \
+        (hist_ring[(row) * hist_cols_cap +                              \
+                   (hist_pos - 1 - (age) + hist_cols_cap) % hist_cols_cap])
+
+// Add a sample of each bar in view.  If the set of bars changed, the
+// history starts over.  Returns how many rows' samples differ from
+// the last ones, or INT_MAX if it started over, so -A can tell when
+// the history holds still.
+int
+hist_add(const struct cpustats *view)
+{
+        if (!view->real)
+                return 0;
+
+        int cpu = -1, row = 0;
+        bool same = true;
+        while (row < hist_rows_cap) {
+                if (row >= hist_nrows || hist_cpus[row] != cpu)
+                        same = false;
+                hist_cpus[row++] = cpu;
+                if ((cpu = cpustats_next(view, cpu + 1)) < 0)
+                        break;
+        }
+        int moved = 0;
+        if (!same || row != hist_nrows) {
+                hist_nrows = row;
+                hist_len = hist_unshown = 0;
+                hist_shown = false;
+                moved = INT_MAX;
+        }
+
+        for (row = 0; row < hist_nrows; row++) {
+                int cpu = hist_cpus[row], i, top = 0;
+                uint64_t scale = ui_scale(view, cpu), busy = 0, most = 0;
+                for (i = 0; i < NSTATS; i++) {
+                        unsigned long long val =
+                                view->field[ui_stats[i].field][cpu];
+                        busy += val;
+                        if (val > most) {
+                                most = val;
+                                top = i;
+                        }
+                }
+                int level = scale ? MIN((busy * 8 + scale / 2) / scale, 8) : 0;
+                unsigned char sample = top << 4 | level;
+                if (hist_len && sample != HIST_SAMPLE(row, 0))
+                        moved++;
+                hist_ring[row * hist_cols_cap + hist_pos] = sample;
+        }
+        hist_pos = (hist_pos + 1) % hist_cols_cap;
+        hist_len = MIN(hist_len + 1, hist_cols_cap);
+        hist_unshown++;
+        return moved;
 }
 
 static void
-term_reset(void)
+hist_put(unsigned char sample, int *lastBack, int *lastFore)
 {
-        if (!term_initialized)
+        int level = sample & 0xf, color = ui_stats[sample >> 4].color;
+        if (level == 0) {
+                ui_set_attrs(0xff, 0xff, lastBack, lastFore);
+                out_putc(' ');
+        } else if (level == 8) {
+                ui_set_attrs(color, 0xff, lastBack, lastFore);
+                out_putc(' ');
+        } else if (ui_ascii) {
+                ui_set_attrs(0xff, color, lastBack, lastFore);
+                out_putc(" .:-=+*#"[level]);
+        } else {
+                ui_set_attrs(0xff, color, lastBack, lastFore);
+                out_puts(ui_chars[level]);
+        }
+}
+
+// Show the history.  If it's already on the screen and nothing but
+// the new samples changed, this only scrolls them in, in at most
+// budget bytes; if they don't fit, they wait for a later frame.
+// Otherwise, or if full is set, it's drawn from scratch.
+void
+hist_show(bool full, size_t budget)
+{
+        char buf[16];
+        int label = 3, row, x;
+        for (row = 1; row < hist_nrows; row++)
+                label = MAX(label, snprintf(buf, sizeof buf, "%d",
+                                            hist_cpus[row]));
+        int width = MAX(MIN(COLS - label - 2, hist_cols_cap), 0);
+        int rows = MAX(MIN(hist_nrows, LINES - ui_top_lines), 0);
+        if (!hist_shown || label != hist_label_len || width != hist_width ||
+            rows != hist_shown_rows || ui_top_lines != hist_shown_top ||
+            hist_unshown >= width || !delete_character)
+                full = true;
+        if (!full && !hist_unshown)
                 return;
-        // Leave invisible mode
-        putp(cursor_normal);
-        // Leave cursor mode
-        putp(exit_ca_mode);
-        fflush(stdout);
-        // Reset terminal modes
-        tcsetattr(0, TCSADRAIN, &term_init_termios);
-        term_initialized = false;
+        size_t start = out_len;
+
+        if (full) {
+                out_putp(exit_attribute_mode);
+                ui_clear();
+                // The bars have to start over after this
+                ui_laid_out = false;
+        }
+        int lastBack = -1, lastFore = -1;
+        for (row = 0; row < rows; row++) {
+                int y = row + ui_top_lines, x0 = label + 1;
+                if (!full) {
+                        // Scroll left and draw the new samples
+                        ui_set_attrs(0xff, 0xff, &lastBack, &lastFore);
+                        out_putp(term_cursor_address(y, x0));
+                        if (parm_dch && hist_unshown > 1)
+                                out_putp(tiparm(parm_dch, hist_unshown));
+                        else
+                                for (x = 0; x < hist_unshown; x++)
+                                        out_putp(delete_character);
+                        out_putp(term_cursor_address(
+                                         y, x0 + width - hist_unshown));
+                        for (x = hist_unshown - 1; x >= 0; x--)
+                                hist_put(HIST_SAMPLE(row, x),
+                                         &lastBack, &lastFore);
+                        continue;
+                }
+                ui_set_attrs(0xff, 0xff, &lastBack, &lastFore);
+                out_putp(term_cursor_address(y, 0));
+                if (row == 0)
+                        snprintf(buf, sizeof buf, "%-*s ", label, "avg");
+                else
+                        snprintf(buf, sizeof buf, "%-*d ", label,
+                                 hist_cpus[row]);
+                out_puts(buf);
+                for (x = 0; x < width; x++) {
+                        int age = width - 1 - x;
+                        hist_put(age < hist_len ? HIST_SAMPLE(row, age) : 0,
+                                 &lastBack, &lastFore);
+                }
+        }
+        out_putp(exit_attribute_mode);
+        if (!full && out_len - start > budget) {
+                out_len = start;
+                return;
+        }
+
+        hist_shown = true;
+        hist_label_len = label;
+        hist_width = width;
+        hist_shown_rows = rows;
+        hist_shown_top = ui_top_lines;
+        hist_unshown = 0;
+}
+
+/******************************************************************
+ * Busy CPU's
+ */
+
+// On big machines running a few busy threads, most bars are empty.
+// busy_view narrows a view down to its busiest entries, so the bars
+// computed and sent scale with the CPU's in use rather than the
+// CPU's installed.
+
+// Utilization, in thousandths, an entry needs to be shown, and below
+// which a shown entry is dropped.  A shown entry also counts as
+// BUSY_STICKY busier when competing for a place, so bars don't trade
+// places (and force a new layout) on every small change in load.
+#define BUSY_ENTER 20
+#define BUSY_LEAVE 5
+#define BUSY_STICKY 100
+
+static struct busy_cand
+{
+        uint64_t score;
+        int cpu;
+} *busy_cands;
+
+// Partition the n candidates in a so the first k have the highest
+// scores, in no particular order.
+static void
+busy_select(struct busy_cand *a, int n, int k)
+{
+        int lo = 0, hi = n - 1;
+        while (lo < hi) {
+                uint64_t pivot = a[lo + (hi - lo) / 2].score;
+                int i = lo, j = hi;
+                while (i <= j) {
+                        while (a[i].score > pivot)
+                                i++;
+                        while (a[j].score < pivot)
+                                j--;
+                        if (i <= j) {
+                                SWAP(a[i], a[j]);
+                                i++;
+                                j--;
+                        }
+                }
+                if (k - 1 <= j)
+                        hi = j;
+                else if (k - 1 >= i)
+                        lo = i;
+                else
+                        break;
+        }
 }
 
+// Make out a copy of view with only the (at most) k busiest entries
+// online.  out must be the result of the previous call, since the
+// entries it has online are the ones that get the benefit of the
+// doubt.  The average bar still covers every CPU.
 void
-term_init(void)
+busy_view(struct cpustats *out, const struct cpustats *in, int k)
 {
-        setupterm(NULL, 1, NULL);
-        if (tcgetattr(0, &term_init_termios) < 0)
-                epanic("failed to get terminal attributes");
+        if (!busy_cands &&
+            !(busy_cands = malloc(cpustats_cpus * sizeof *busy_cands)))
+                epanic("allocating busy candidates");
+        if (in->weight && !out->weight &&
+            !(out->weight = malloc(cpustats_cpus * sizeof *out->weight)))
+                epanic("allocating view weights");
 
-        // Handle terminal resize
-        struct sigaction act = {
-                .sa_handler = term_on_sigwinch
-        };
-        if (sigaction(SIGWINCH, &act, NULL) < 0)
-                epanic("failed to install SIGWINCH handler");
+        int n = 0, cpu, i;
+        FOR_EACH_ONLINE(cpu, in) {
+                uint64_t scale = ui_scale(in, cpu), busy = 0;
+                for (i = 0; i < NSTATS; i++)
+                        busy += in->field[ui_stats[i].field][cpu];
+                uint64_t util = scale ? busy * 1000 / scale : 0;
+                if (cpustats_online(out, cpu)) {
+                        if (util < BUSY_LEAVE)
+                                continue;
+                        util += BUSY_STICKY;
+                } else if (util < BUSY_ENTER) {
+                        continue;
+                }
+                busy_cands[n].score = util;
+                busy_cands[n++].cpu = cpu;
+        }
+        if (n > k) {
+                busy_select(busy_cands, n, k);
+                n = k;
+        }
 
-        atexit(term_reset);
-        term_initialized = true;
+        // Only the chosen entries need their counters copied
+        memset(out->online_map, 0,
+               CPUSTATS_WORDS(out->cpus) * sizeof *out->online_map);
+        out->online = out->max = 0;
+        out->real = in->real;
+        out->peak = in->peak;
+        out->p95 = in->p95;
+        out->avg_weight = in->avg_weight;
+        out->avg_capacity = in->avg_capacity ? in->avg_capacity :
+                1000 * (in->weight ? in->avg_weight : in->online);
+        int field;
+        for (field = 0; field < NFIELDS; field++)
+                out->field[field][-1] = in->field[field][-1];
+        for (i = 0; i < n; i++) {
+                cpu = busy_cands[i].cpu;
+                for (field = 0; field < NFIELDS; field++)
+                        out->field[field][cpu] = in->field[field][cpu];
+                if (in->weight)
+                        out->weight[cpu] = in->weight[cpu];
+                cpustats_set_online(out, cpu);
+                out->online++;
+                out->max = MAX(out->max, cpu);
+        }
+        if (!in->weight) {
+                free(out->weight);
+                out->weight = NULL;
+        }
+}
 
-        // Enter cursor mode
-        putp(enter_ca_mode);
-        // Enter invisible mode
-        putp(cursor_invisible);
-        // Disable echo and enter canonical (aka cbreak) mode so we
-        // get input without waiting for newline
-        struct termios tc = term_init_termios;
-        tc.c_lflag &= ~(ICANON | ECHO);
-        tc.c_iflag &= ~ICRNL;
-        tc.c_lflag |= ISIG;
-        tc.c_cc[VMIN] = 1;
-        tc.c_cc[VTIME] = 0;
-        if (tcsetattr(0, TCSAFLUSH, &tc) < 0)
-                epanic("failed to set terminal attributes");
+/******************************************************************
+ * Streaming output
+ */
+
+// With -o, each tick's percentages go to stdout as JSON lines or CSV,
+// for other programs to collect, instead of being drawn.  It all goes
+// through out_buf, which stops growing after the first tick, and the
+// numbers are formatted by hand, since a printf per field would cost
+// more than reading the statistics.
+
+// STREAM_QUIET ("none") samples without writing anything, for -m.
+enum stream_format { STREAM_NONE, STREAM_JSON, STREAM_CSV, STREAM_QUIET };
+
+// Output cpu's entry, or the average's if cpu is -1.  In CSV this is
+// a row of its own; in JSON, a member of the "cpus" object.
+static void
+stream_entry(enum stream_format format, const struct cpustats *delta,
+             int cpu, uint64_t now)
+{
+        if (format == STREAM_CSV) {
+                out_put_fixed(now / 1000, 3);
+                out_putc(',');
+        } else {
+                if (cpu >= 0)
+                        out_putc(',');
+                out_putc('"');
+        }
+        if (cpu < 0)
+                out_puts("avg");
+        else
+                out_put_uint(cpu);
+        if (format == STREAM_JSON)
+                out_puts("\":{");
+
+        uint64_t scale = ui_scale(delta, cpu);
+        int i;
+        for (i = 0; i < NSTATS; i++) {
+                // In hundredths of a percent
+                unsigned long long val = delta->field[ui_stats[i].field][cpu];
+                val = scale ? MIN((val * 10000 + scale / 2) / scale, 10000) : 0;
+                if (format == STREAM_JSON) {
+                        if (i)
+                                out_putc(',');
+                        out_putc('"');
+                        out_puts(ui_stats[i].name);
+                        out_puts("\":");
+                } else {
+                        out_putc(',');
+                }
+                out_put_fixed(val, 2);
+        }
+        out_putc(format == STREAM_JSON ? '}' : '\n');
 }
 
-// Handle any terminal resize that has happened since the last
-// `term_init' or `term_check_resize'.  Return true if there was a
-// resize.
-bool
-term_check_resize(void)
+// Output one tick.  JSON lines look like
+//   {"time":1700000000.123,"load":[0.50,0.40,0.30],
+//    "cpus":{"avg":{"nice":0.00,"user":1.23,...},"0":{...},...}}
+// and CSV has a row for the average and each CPU, under the header
+// from stream_header.  Times are seconds since the epoch, and the
+// rest are percentages.
+void
+stream_tick(enum stream_format format, const struct cpustats *delta,
+            float load[3])
 {
-        if (!term_need_resize)
-                return false;
+        if (format == STREAM_QUIET)
+                return;
+        uint64_t now = time_wall_usec();
+        int cpu, i;
+        if (format == STREAM_JSON) {
+                out_puts("{\"time\":");
+                out_put_fixed(now / 1000, 3);
+                out_puts(",\"load\":[");
+                for (i = 0; i < 3; i++) {
+                        if (i)
+                                out_putc(',');
+                        out_put_fixed(load[i] * 100 + 0.5, 2);
+                }
+                out_puts("],\"cpus\":{");
+        }
+        stream_entry(format, delta, -1, now);
+        FOR_EACH_ONLINE(cpu, delta)
+                stream_entry(format, delta, cpu, now);
+        if (format == STREAM_JSON)
+                out_puts("}}\n");
+}
 
-        term_need_resize = 0;
-        // restartterm is overkill, but appears to be the only way to
-        // get ncurses to update the terminal size when using the
-        // low-level routines.
-        restartterm(NULL, 1, NULL);
-        return true;
+void
+stream_header(enum stream_format format)
+{
+        if (format != STREAM_CSV)
+                return;
+        out_puts("time,cpu");
+        int i;
+        for (i = 0; i < NSTATS; i++) {
+                out_putc(',');
+                out_puts(ui_stats[i].name);
+        }
+        out_putc('\n');
 }
 
 /******************************************************************
- * UI
+ * Shared memory
  */
 
-static const struct ui_stat
+// With -m, every sample is also published to a shared memory object,
+// so other processes on the host can follow the statistics without
+// reading procfs themselves, or making any system calls at all.
+//
+// The object starts with a struct shm_header, followed by a ring of
+// slots slot_size bytes apart.  Each slot is a struct shm_slot
+// followed by cpus + 1 struct shm_cpu records, the aggregate first.
+// All counters are in clock ticks, in the order of struct cpustat
+// (user, nice, sys, iowait, irq, softirq, steal, guest, guest_nice),
+// with guest time not counted in user.  A reader:
+//
+//   1. Waits for magic to be SHM_MAGIC, and checks version.
+//   2. Loads latest (acquire).  Sample latest is in slot
+//      (latest - 1) % slots.
+//   3. Loads the slot's seq (acquire), copies the slot, issues an
+//      acquire fence, and loads seq again.  If seq was odd or
+//      changed, the slot was being overwritten, so go back to 2.
+//
+// A slot is only rewritten after slots - 1 newer samples, so readers
+// rarely retry.  The object is removed when cpubars exits.
+
+#define SHM_MAGIC "cpubars"
+#define SHM_VERSION 1
+#define SHM_SLOTS 8
+
+struct shm_header
 {
-        const char *name;
-        int color;
-        int offset;
-} ui_stats[] = {
-#define FIELD(name, color) {#name, color, offsetof(struct cpustat, name)}
-        FIELD(nice, COLOR_GREEN), FIELD(user, COLOR_BLUE),
-        FIELD(sys, COLOR_RED), FIELD(iowait, COLOR_CYAN),
-        FIELD(irq, COLOR_MAGENTA), FIELD(softirq, COLOR_YELLOW),
-        // We set the color of the sentinel stat to 0xff so we can
-        // safely refer to ui_stats[NSTATS].color as the last, "idle"
-        // segment of a bar.
-        {NULL, 0xff, 0}
-#undef FIELD
+        char magic[8];
+        uint32_t version, slots, slot_size, cpus, fields, clk_tck;
+        // The number of samples published so far
+        uint64_t latest;
 };
-#define NSTATS (sizeof(ui_stats)/sizeof(ui_stats[0]) - 1)
 
-// If we have too many bars to fit on the screen, we divide the screen
-// into "panes".  Wrapping the display into these panes is handled by
-// the final output routine.
-static struct ui_pane
+// struct shm_cpu flags
+#define SHM_ONLINE 1            // Online in the snapshot
+#define SHM_DELTA 2             // Online in both snapshots of the delta
+
+struct shm_slot
 {
-        // start is the "length dimension" of the start of this pane
-        // (for vertical bars, the row, relative to the bottom).
-        // barpos is the first barpos that appears in this pane (for
-        // vertical bars, the column).  width is the size of this pane
-        // in the width dimension (for vertical bars, the number of
-        // columns).
-        int start, barpos, width;
-} *ui_panes;
-static int ui_num_panes;
+        // Odd while the slot is being written
+        uint64_t seq;
+        // Wall-clock time of the sample in microseconds since the
+        // epoch, and the clock ticks the snapshot and delta cover
+        uint64_t time, real, delta_real;
+        float load[3];
+        // The number of CPU's with SHM_DELTA set
+        uint32_t online;
+};
 
-static struct ui_bar
+struct shm_cpu
 {
-        int start, width, cpu;
-} *ui_bars;
-static int ui_num_bars;
+        uint64_t flags;
+        uint64_t snap[NFIELDS], delta[NFIELDS];
+};
 
-// The layout of ui_display, etc is independent of final display
-// layout, hence we avoid the terms "row", "column", "x", and "y".
-// Rather, bar display is laid out as
+static char shm_name[NAME_MAX];
+static struct shm_header *shm_header;
+static size_t shm_slot_size;
+
+static void
+shm_remove(void)
+{
+        shm_unlink(shm_name);
+}
+
+// Create shared memory object name, replacing any left by an earlier
+// run.
+void
+shm_init(const char *name)
+{
+        snprintf(shm_name, sizeof shm_name, "%s%s", name[0] == '/' ? "" : "/",
+                 name);
+        shm_slot_size = sizeof(struct shm_slot) +
+                (cpustats_cpus + 1) * sizeof(struct shm_cpu);
+        size_t size = sizeof(struct shm_header) + SHM_SLOTS * shm_slot_size;
+
+        // Readers of an old object keep their mapping of it, rather
+        // than seeing it change size under them
+        shm_unlink(shm_name);
+        int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0)
+                epanic("failed to create shared memory %s", shm_name);
+        if (ftruncate(fd, size) < 0)
+                epanic("failed to size shared memory %s", shm_name);
+        void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0);
+        if (mem == MAP_FAILED)
+                epanic("failed to map shared memory %s", shm_name);
+        close(fd);
+        atexit(shm_remove);
+
+        shm_header = mem;
+        shm_header->version = SHM_VERSION;
+        shm_header->slots = SHM_SLOTS;
+        shm_header->slot_size = shm_slot_size;
+        shm_header->cpus = cpustats_cpus;
+        shm_header->fields = NFIELDS;
+        shm_header->clk_tck = cpustats_clk_tck;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(shm_header->magic, SHM_MAGIC, sizeof SHM_MAGIC);
+}
+
+// Publish snapshot snap and the delta leading up to it.
+void
+shm_publish(const struct cpustats *snap, const struct cpustats *delta,
+            const float load[3])
+{
+        if (!shm_header)
+                return;
+        uint64_t n = shm_header->latest;
+        struct shm_slot *slot = (struct shm_slot*)
+                ((char*)(shm_header + 1) + n % SHM_SLOTS * shm_slot_size);
+        struct shm_cpu *rec = (struct shm_cpu*)(slot + 1);
+
+        uint64_t seq = slot->seq;
+        __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        slot->time = time_wall_usec();
+        slot->real = snap->real;
+        slot->delta_real = delta->real;
+        memcpy(slot->load, load, sizeof slot->load);
+        slot->online = delta->online;
+        int cpu, field;
+        for (cpu = -1; cpu < cpustats_cpus; cpu++, rec++) {
+                rec->flags = cpu < 0 ? SHM_ONLINE | SHM_DELTA :
+                        (cpustats_online(snap, cpu) ? SHM_ONLINE : 0) |
+                        (cpustats_online(delta, cpu) ? SHM_DELTA : 0);
+                if (!rec->flags)
+                        continue;
+                for (field = 0; field < NFIELDS; field++) {
+                        rec->snap[field] = snap->field[field][cpu];
+                        rec->delta[field] = delta->field[field][cpu];
+                }
+        }
+
+        __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+        __atomic_store_n(&shm_header->latest, n + 1, __ATOMIC_RELEASE);
+}
+
+#ifndef CPUBARS_BENCH
+/******************************************************************
+ * Sampler
+ */
+
+// With -T, a thread of its own reads the statistics on schedule, so a
+// terminal that can't keep up (say, a full SSH window blocking our
+// write) can't stretch the interval a sample covers.  Once it starts,
+// it is the only thread that reads the statistics, and it hands whole
+// snapshots to the display through a small ring.  The display only
+// wants the latest one: its delta from the last snapshot drawn covers
+// everything in between, so the snapshots it never gets to are simply
+// dropped.
 //
-//           len
-//           012345678 <- ui_bar_length
-//  barpos 0 |--bar--|
-//         1
-//         2 |--bar--|
-//         ^- ui_bar_width
-static int ui_bar_length, ui_bar_width;
-// ui_display, ui_fore, and ui_back are 2-D arrays that should be
-// indexed using UIXY.  ui_display stores indexes into ui_chars.
-// ui_fore and ui_back store color codes or 0xff for default
-// attributes.
-static unsigned char *ui_display, *ui_fore, *ui_back;
-#define UIXY(array, barpos, len) (array[(barpos)*ui_bar_length + (len)])
+// The sampler never waits for the display.  As in shm_publish, each
+// slot has a sequence number that is odd while the slot is being
+// written, and the display retries if the slot changed under it.
+//
+// With -u, the sampler takes several samples per update, and keeps
+// the peak and 95th percentile of each CPU's busy fraction over the
+// samples since the display last took one, so the bars can mark
+// bursts too short for the update interval to show.  Each CPU has a
+// histogram of CPUSTATS_PEAK_SCALE buckets for this, and the 95th
+// percentile moves a bucket or so per sample, so the cost per sample
+// doesn't depend on how many samples there are.
+
+#define SAMPLER_SLOTS 4
+
+struct sampler_peak
+{
+        // The number of samples, and how many of them are above
+        // bucket p95
+        uint16_t n, above;
+        uint8_t peak, p95;
+        uint16_t count[CPUSTATS_PEAK_SCALE];
+};
+
+struct sampler_slot
+{
+        unsigned seq;
+        struct cpustats *snap;
+        float load[3];
+        int runnable;
+        bool pressure;
+        float some[3], full[3];
+        // With -u, the peaks so far, indexed by CPU + 1
+        uint8_t *peak, *p95;
+};
+
+static struct sampler_slot sampler_ring[SAMPLER_SLOTS];
+// The number of samples taken so far
+static unsigned long sampler_head;
+static uint64_t sampler_period;
+// The sampler writes a byte to this pipe after every sampler_subs
+// samples
+static int sampler_wake[2];
+static int sampler_subs;
+// The sampler's own last snapshot and delta, for shm_publish and the
+// peaks
+static struct cpustats *sampler_prev, *sampler_delta;
+// The peaks of each CPU + 1.  The display counts the samples it took
+// in sampler_taken, and the sampler starts over whenever that moves.
+static struct sampler_peak *sampler_peaks;
+static unsigned long sampler_taken, sampler_reset;
+// The peaks of the last sample taken, for sampler_mark
+static uint8_t *sampler_shown_peak, *sampler_shown_p95;
+// The pressure of the last sample taken, for sampler_pressure
+static bool sampler_has_pressure;
+static float sampler_some[3], sampler_full[3];
+
+// Add delta to the peaks, and copy them to slot.
+static void
+sampler_add_peaks(const struct cpustats *delta, struct sampler_slot *slot)
+{
+        unsigned long taken = __atomic_load_n(&sampler_taken,
+                                              __ATOMIC_RELAXED);
+        if (taken != sampler_reset) {
+                memset(sampler_peaks, 0,
+                       (cpustats_cpus + 1) * sizeof *sampler_peaks);
+                sampler_reset = taken;
+        }
+
+        int cpu, i;
+        for (cpu = -1; cpu < cpustats_cpus; cpu++) {
+                struct sampler_peak *p = &sampler_peaks[cpu + 1];
+                if (cpu < 0 || cpustats_online(delta, cpu)) {
+                        uint64_t scale = ui_scale(delta, cpu), busy = 0;
+                        for (i = 0; i < NSTATS; i++)
+                                busy += delta->field[ui_stats[i].field][cpu];
+                        int v = scale ? MIN(busy * CPUSTATS_PEAK_SCALE / scale,
+                                            CPUSTATS_PEAK_SCALE - 1) : 0;
+                        p->peak = MAX(p->peak, v);
+                        if (p->n < UINT16_MAX) {
+                                p->n++;
+                                p->count[v]++;
+                                if (v > p->p95)
+                                        p->above++;
+                                // Keep p95 the lowest bucket with at
+                                // most 5% of the samples above it
+                                while (p->above > p->n / 20)
+                                        p->above -= p->count[++p->p95];
+                                while (p->p95 && p->above +
+                                       p->count[p->p95] <= p->n / 20)
+                                        p->above += p->count[p->p95--];
+                        }
+                }
+                slot->peak[cpu + 1] = p->peak;
+                slot->p95[cpu + 1] = p->p95;
+        }
+}
+
+static void
+sampler_sample(void)
+{
+        unsigned long head = sampler_head;
+        struct sampler_slot *slot = &sampler_ring[head % SAMPLER_SLOTS];
+        unsigned seq = slot->seq;
+        __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
 
-#define NCHARS 8
-static char ui_chars[NCHARS][MB_LEN_MAX];
-static bool ui_ascii;
+        cpustats_read(slot->snap);
+        __atomic_store_n(&slot->runnable, cpustats_loadavg(slot->load),
+                         __ATOMIC_RELAXED);
+        // Always read the pressure, since only this thread may
+        slot->pressure = cpustats_pressure(slot->some, slot->full);
+
+        if (sampler_prev) {
+                SWAP(sampler_prev, sampler_delta);
+                cpustats_copy(sampler_prev, slot->snap);
+                if (head)
+                        cpustats_delta(sampler_delta, sampler_prev);
+                if (head && sampler_peaks)
+                        sampler_add_peaks(sampler_delta, slot);
+        }
+
+        __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+        __atomic_store_n(&sampler_head, head + 1, __ATOMIC_RELEASE);
+
+        if (head && shm_header)
+                shm_publish(sampler_prev, sampler_delta, slot->load);
+}
+
+static void *
+sampler_main(void *arg)
+{
+        int cpu = *(int*)arg;
+        if (cpu >= 0) {
+#ifdef __linux__
+                // Raw, like io_uring, so we don't need _GNU_SOURCE for
+                // cpu_set_t.  Thread 0 is the calling thread.
+                enum { BITS = sizeof(unsigned long) * 8 };
+                unsigned long mask[cpu / BITS + 1];
+                memset(mask, 0, sizeof mask);
+                mask[cpu / BITS] = 1ul << (cpu % BITS);
+                if (syscall(SYS_sched_setaffinity, 0, sizeof mask, mask) < 0)
+                        epanic("failed to pin the sampler to CPU %d", cpu);
+#else
+                panic("-T CPU is only supported on Linux");
+#endif
+        }
+
+        struct tick tick;
+        tick_init(&tick, sampler_period);
+        while (1) {
+                // Sleep to an absolute time, so the cadence doesn't
+                // drift by the time each sample takes
+                struct timespec ts = {
+                        .tv_sec = tick.next / 1000000,
+                        .tv_nsec = tick.next % 1000000 * 1000
+                };
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                       &ts, NULL) == EINTR);
+                tick_advance(&tick);
+                sampler_sample();
+                if (sampler_head % sampler_subs)
+                        continue;
+
+                // If the pipe is full, the display has a wakeup
+                // pending already
+                char ch = 0;
+                if (write(sampler_wake[1], &ch, 1) < 0 && errno != EAGAIN)
+                        epanic("failed to wake the display");
+        }
+        return NULL;
+}
 
+// Take the first sample, then start the sampler taking subs every
+// delay milliseconds, pinned to cpu if it isn't -1.  After this,
+// sampler_wake[0] becomes readable whenever there's a new update.
 void
-ui_init(bool force_ascii)
+sampler_start(int delay, int cpu, int subs)
 {
-        // Cell character 0 is always a space
-        strcpy(ui_chars[0], " ");
+        static int sampler_cpu;
+        int i;
 
-#ifdef __STDC_ISO_10646__
-        if (force_ascii) {
-                ui_ascii = true;
-                return;
+        if (cpu >= cpustats_cpus)
+                panic("-T: there is no CPU %d", cpu);
+        for (i = 0; i < SAMPLER_SLOTS; i++)
+                sampler_ring[i].snap = cpustats_alloc();
+        if (subs > 1) {
+                size_t n = cpustats_cpus + 1;
+                if (!(sampler_peaks = calloc(n, sizeof *sampler_peaks)) ||
+                    !(sampler_shown_peak = calloc(n, 1)) ||
+                    !(sampler_shown_p95 = calloc(n, 1)))
+                        epanic("allocating peaks");
+                for (i = 0; i < SAMPLER_SLOTS; i++)
+                        if (!(sampler_ring[i].peak = calloc(n, 1)) ||
+                            !(sampler_ring[i].p95 = calloc(n, 1)))
+                                epanic("allocating peaks");
         }
+        if (shm_header || subs > 1) {
+                sampler_prev = cpustats_alloc();
+                sampler_delta = cpustats_alloc();
+        }
+        sampler_subs = subs;
+        sampler_period = delay * 1000 / subs;
+        sampler_cpu = cpu;
+        if (pipe(sampler_wake) < 0)
+                epanic("pipe failed");
+        fcntl(sampler_wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(sampler_wake[1], F_SETFL, O_NONBLOCK);
 
-        // Encode Unicode cell characters using system locale
-        char *origLocale = setlocale(LC_CTYPE, NULL);
-        setlocale(LC_CTYPE, "");
+        sampler_sample();
 
-        int ch;
-        mbstate_t mbs;
-        memset(&mbs, 0, sizeof mbs);
-        for (ch = 1; ch < NCHARS; ch++) {
-                int len = wcrtomb(ui_chars[ch], 0x2580 + ch, &mbs);
-                if (len == -1 || !mbsinit(&mbs)) {
-                        ui_ascii = true;
-                        break;
-                }
-                ui_chars[ch][len] = 0;
+        // Leave the signals to the display thread
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, sampler_main, &sampler_cpu);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (err) {
+                errno = err;
+                epanic("failed to start the sampler");
         }
+}
 
-        // Restore the original locale
-        setlocale(LC_CTYPE, origLocale);
-#else
-        ui_ascii = true;
-#endif
+// Empty the wakeup pipe once poll says it's readable.
+void
+sampler_drain(void)
+{
+        char buf[64];
+        if (read(sampler_wake[0], buf, sizeof buf) < 0 && errno != EAGAIN)
+                epanic("read failed");
+        sys_calls++;
 }
 
-static void
-ui_init_panes(int n)
+// Copy the latest sample into snap and its load averages into load.
+// Returns its number of runnable tasks, as cpustats_loadavg.
+int
+sampler_take(struct cpustats *snap, float load[3])
 {
-        free(ui_panes);
-        ui_num_panes = n;
-        if (!(ui_panes = malloc(n * sizeof *ui_panes)))
-                epanic("allocating panes");
-        
+        while (1) {
+                unsigned long head =
+                        __atomic_load_n(&sampler_head, __ATOMIC_ACQUIRE);
+                struct sampler_slot *slot =
+                        &sampler_ring[(head - 1) % SAMPLER_SLOTS];
+                unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+                if (seq & 1)
+                        // The sampler lapped us
+                        continue;
+                cpustats_copy(snap, slot->snap);
+                memcpy(load, slot->load, sizeof slot->load);
+                int runnable = slot->runnable;
+                sampler_has_pressure = slot->pressure;
+                memcpy(sampler_some, slot->some, sizeof sampler_some);
+                memcpy(sampler_full, slot->full, sizeof sampler_full);
+                if (sampler_peaks) {
+                        memcpy(sampler_shown_peak, slot->peak,
+                               cpustats_cpus + 1);
+                        memcpy(sampler_shown_p95, slot->p95,
+                               cpustats_cpus + 1);
+                }
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+                        continue;
+                // Start the peaks over
+                __atomic_store_n(&sampler_taken, sampler_taken + 1,
+                                 __ATOMIC_RELAXED);
+                return runnable;
+        }
 }
 
+// Attach the peaks of the last sample taken to delta, if there are
+// any.
 void
-ui_layout(struct cpustats *cpus)
+sampler_mark(struct cpustats *delta)
 {
-        int i;
+        delta->peak = sampler_peaks ? sampler_shown_peak + 1 : NULL;
+        delta->p95 = sampler_peaks ? sampler_shown_p95 + 1 : NULL;
+}
 
-        putp(exit_attribute_mode);
-        putp(clear_screen);
+// Return the number of runnable tasks in the latest sample, without
+// taking it.
+int
+sampler_runnable(void)
+{
+        unsigned long head = __atomic_load_n(&sampler_head, __ATOMIC_ACQUIRE);
+        return __atomic_load_n(&sampler_ring[(head - 1) % SAMPLER_SLOTS].runnable,
+                               __ATOMIC_RELAXED);
+}
 
-        // Draw key at the top
-        const struct ui_stat *si;
-        for (si = ui_stats; si->name; si++) {
-                putp(tiparm(set_a_background, si->color));
-                printf("  ");
-                putp(exit_attribute_mode);
-                printf(" %s ", si->name);
-        }
+// Like cpustats_pressure, for the last sample taken.
+bool
+sampler_pressure(float some[3], float full[3])
+{
+        memcpy(some, sampler_some, sizeof sampler_some);
+        memcpy(full, sampler_full, sizeof sampler_full);
+        return sampler_has_pressure;
+}
 
-        // Create one pane by default
-        ui_init_panes(1);
-        ui_panes[0].barpos = 0;
+/******************************************************************
+ * Main
+ */
 
-        // Create bar info
-        free(ui_bars);
-        ui_num_bars = cpus->online + 1;
-        ui_bars = malloc(ui_num_bars * sizeof *ui_bars);
-        if (!ui_bars)
-                epanic("allocating bars");
+static sig_atomic_t need_exit;
 
-        // Create average bar
-        ui_bars[0].start = 0;
-        ui_bars[0].width = 3;
-        ui_bars[0].cpu = -1;
+void
+on_sigint(int sig)
+{
+        need_exit = 1;
+}
 
-        // Lay out labels
-        char buf[16];
-        snprintf(buf, sizeof buf, "%d", cpus->max);
-        int length = strlen(buf);
-        int label_len;
-        int w = COLS - 4;
+// Record statistics to path every delay milliseconds until
+// interrupted.  This doesn't touch the terminal at all.
+static void
+main_record(const char *path, int delay)
+{
+        // We keep two snapshots.  Each new snapshot is read over the
+        // last delta, and then the previous snapshot is replaced by
+        // the delta between the two.
+        struct cpustats *snap = cpustats_alloc(), *delta = cpustats_alloc();
 
-        if ((length + 1) * cpus->online < w) {
-                // Lay out the labels horizontally
-                ui_panes[0].start = 1;
-                ui_bar_length = MAX(0, LINES - ui_panes[0].start - 2);
-                label_len = 1;
-                putp(tiparm(cursor_address, LINES, 0));
-                int bar = 1;
-                for (i = 0; i <= cpus->max; ++i) {
-                        if (cpus->cpus[i].online) {
-                                ui_bars[bar].start = 4 + (bar-1)*(length+1);
-                                ui_bars[bar].width = length;
-                                ui_bars[bar].cpu = i;
-                                bar++;
-                        }
+        cpustats_read(snap);
+        rec_open(path);
+        struct tick tick;
+        tick_init(&tick, delay * 1000);
+        while (!need_exit) {
+                int timeout = tick_timeout(&tick);
+                if (timeout > 0) {
+                        if (poll(NULL, 0, timeout) < 0 && errno != EINTR)
+                                epanic("poll failed");
+                        continue;
                 }
-        } else {
-                // Lay out the labels vertically
-                int pad = 0, count = cpus->online;
-                ui_panes[0].start = length;
-                ui_bar_length = MAX(0, LINES - ui_panes[0].start - 2);
-                label_len = length;
+                tick_advance(&tick);
 
-                if (cpus->online * 2 < w) {
-                        // We have space for padding
-                        pad = 1;
-                } else if (cpus->online >= w && COLS >= 2) {
-                        // We don't have space for all of them
-                        int totalw = 4 + cpus->online;
-                        ui_init_panes((totalw + COLS - 2) / (COLS - 1));
-                        int plength = (LINES - 2) / ui_num_panes;
-                        for (i = 0; i < ui_num_panes; ++i) {
-                                ui_panes[i].start =
-                                        (ui_num_panes-i-1) * plength + length;
-                                ui_panes[i].barpos = i * (COLS - 1);
-                                ui_panes[i].width = COLS - 1;
-                        }
-                        ui_bar_length = MAX(0, plength - length);
-                }
+                cpustats_read(delta);
+                cpustats_delta(snap, delta);
+                SWAP(snap, delta);
+                float loadavg[3];
+                cpustats_loadavg(loadavg);
+                shm_publish(snap, delta, loadavg);
+                rec_delta(delta, loadavg);
+                if (rec_count >= REC_KEYFRAME_RECORDS)
+                        rec_keyframe();
+        }
+        rec_close();
+}
 
-                int bar = 1;
-                for (i = 0; i <= cpus->max; ++i) {
-                        if (cpus->cpus[i].online) {
-                                ui_bars[bar].start = 4 + (bar-1)*(pad+1);
-                                ui_bars[bar].width = 1;
-                                ui_bars[bar].cpu = i;
-                                bar++;
-                        }
+// Write statistics to stdout in format every delay milliseconds
+// until interrupted.  Like main_record, this doesn't touch the
+// terminal.
+static void
+main_stream(enum stream_format format, int delay)
+{
+        // As in main_record
+        struct cpustats *snap = cpustats_alloc(), *delta = cpustats_alloc();
+
+        stream_header(format);
+        out_flush();
+        cpustats_read(snap);
+        struct tick tick;
+        tick_init(&tick, delay * 1000);
+        while (!need_exit) {
+                int timeout = tick_timeout(&tick);
+                if (timeout > 0) {
+                        if (poll(NULL, 0, timeout) < 0 && errno != EINTR)
+                                epanic("poll failed");
+                        continue;
                 }
+                tick_advance(&tick);
+
+                cpustats_read(delta);
+                cpustats_delta(snap, delta);
+                SWAP(snap, delta);
+                float loadavg[3];
+                cpustats_loadavg(loadavg);
+                shm_publish(snap, delta, loadavg);
+                stream_tick(format, delta, loadavg);
+                out_flush();
         }
+}
 
-        // Allocate bar display buffers
-        free(ui_display);
-        free(ui_fore);
-        free(ui_back);
-        ui_bar_width = ui_bars[ui_num_bars-1].start + ui_bars[ui_num_bars-1].width;
-        if (!(ui_display = malloc(ui_bar_length * ui_bar_width)))
-                epanic("allocating display buffer");
-        if (!(ui_fore = malloc(ui_bar_length * ui_bar_width)))
-                epanic("allocating foreground buffer");
-        if (!(ui_back = malloc(ui_bar_length * ui_bar_width)))
-                epanic("allocating background buffer");
+// Serve statistics to clients on [HOST:]PORT every delay
+// milliseconds until interrupted.  Like main_record, this doesn't
+// touch the terminal.
+static void
+main_serve(const char *spec, int delay)
+{
+        struct cpustats *snap = cpustats_alloc(), *delta = cpustats_alloc();
 
-        if (ui_ascii) {
-                // ui_display and ui_fore don't change in ASCII mode
-                memset(ui_display, 0, ui_bar_length * ui_bar_width);
-                memset(ui_fore, 0xff, ui_bar_length * ui_bar_width);
-        }
+        net_listen(spec);
+        rec_header();
+        net_save_header();
+        out_sink = net_send;
 
-        // Trim down the last pane to the right width
-        ui_panes[ui_num_panes - 1].width =
-                ui_bar_width - ui_panes[ui_num_panes - 1].barpos;
+        cpustats_read(snap);
+        struct tick tick;
+        tick_init(&tick, delay * 1000);
+        while (!need_exit) {
+                int timeout = tick_timeout(&tick);
+                if (timeout > 0) {
+                        struct pollfd pollfd = {
+                                .fd = net_listen_fd,
+                                .events = POLLIN
+                        };
+                        if (poll(&pollfd, 1, timeout) < 0 && errno != EINTR)
+                                epanic("poll failed");
+                        if ((pollfd.revents & POLLIN) && net_accept())
+                                rec_keyframe();
+                        continue;
+                }
+                tick_advance(&tick);
 
-        // Draw labels
-        char *label_buf = malloc(ui_bar_width * label_len);
-        if (!label_buf)
-                epanic("allocating label buffer");
-        memset(label_buf, ' ', ui_bar_width * label_len);
-        int bar;
-        for (bar = 0; bar < ui_num_bars; ++bar) {
-                char *out = &label_buf[ui_bars[bar].start];
-                int len;
-                if (bar == 0) {
-                        strcpy(buf, "avg");
-                        len = 3;
-                } else
-                        len = snprintf(buf, sizeof buf, "%d", ui_bars[bar].cpu);
-                if (label_len == 1 || bar == 0)
-                        memcpy(out, buf, len);
-                else
-                        for (i = 0; i < len; i++)
-                                out[i * ui_bar_width] = buf[i];
+                // Keep sampling even with no clients, so a new client
+                // gets a delta over a full tick
+                cpustats_read(delta);
+                cpustats_delta(snap, delta);
+                SWAP(snap, delta);
+                float loadavg[3];
+                cpustats_loadavg(loadavg);
+                shm_publish(snap, delta, loadavg);
+                if (!net_nclients)
+                        continue;
+                rec_delta(delta, loadavg);
+                if (rec_count >= REC_KEYFRAME_RECORDS)
+                        rec_keyframe();
         }
-        for (i = 0; i < ui_num_panes; ++i) {
-                putp(tiparm(cursor_address, LINES - ui_panes[i].start, 0));
+}
 
-                int row;
-                for (row = 0; row < label_len; ++row) {
-                        if (row > 0)
-                                putchar('\n');
-                        fwrite(&label_buf[row*ui_bar_width + ui_panes[i].barpos],
-                               1, ui_panes[i].width, stdout);
+// Show statistics streamed from the n servers at addrs, redrawing
+// at most every delay milliseconds.
+static void
+main_client(const char **addrs, int n, int delay, bool force_ascii)
+{
+        dash_init(addrs, n);
+        term_init();
+        ui_init(force_ascii);
+        net_watch(0, -1);
+
+        // Updates from any number of hosts are drawn together at the
+        // next redraw, which comes at most every delay milliseconds
+        bool dirty = false, relayout = true;
+        uint64_t next_draw = 0;
+        while (!need_exit) {
+                int timeout = -1;
+                if (dirty) {
+                        uint64_t now = time_usec();
+                        timeout = next_draw > now ?
+                                (next_draw - now + 999) / 1000 : 0;
                 }
-        }
-        free(label_buf);
+                int ids[64], nids = 0, i;
+                if (timeout != 0)
+                        nids = net_wait(ids, 64, timeout);
+                if (term_check_resize())
+                        dirty = relayout = true;
+                for (i = 0; i < nids; i++) {
+                        if (ids[i] >= 0) {
+                                dirty |= dash_receive(ids[i]);
+                                continue;
+                        }
+                        char ch = 0;
+                        if (read(0, &ch, 1) < 0)
+                                epanic("read failed");
+                        if (ch == 'q') {
+                                need_exit = 1;
+                        } else if (ch == 'd' && n > 1) {
+                                dash_only = dash_only < 0 ?
+                                        dash_step(n - 1, 1) : -1;
+                                dirty = relayout = true;
+                        } else if ((ch == '[' || ch == ']') &&
+                                   dash_only >= 0) {
+                                dash_only = dash_step(dash_only,
+                                                      ch == '[' ? -1 : 1);
+                                dirty = relayout = true;
+                        }
+                }
+                uint64_t now = time_usec();
+                if (!dirty || now < next_draw)
+                        continue;
 
+                float loadavg[3];
+                struct cpustats *view = dash_current(loadavg);
+                dirty = false;
+                if (!view) {
+                        // Nothing to show of this view yet
+                        ui_show_status(dash_describe());
+                        out_flush();
+                        continue;
+                }
+                next_draw = now + delay * 1000;
+                if (relayout || !cpustats_sets_equal(view, dash_layout)) {
+                        ui_set_groups(dash_only < 0 ? n : 0, dash_groups,
+                                      dash_names);
+                        ui_layout(view);
+                        cpustats_copy_set(dash_layout, view);
+                        relayout = false;
+                }
+                ui_show_load(loadavg);
+                if (view->real) {
+                        ui_compute_bars(view);
+                        ui_show_bars(SIZE_MAX);
+                }
+                ui_show_status(dash_describe());
+                out_flush();
+        }
 }
 
-void
-ui_show_load(float load[3])
+// Show the time of the current playback position, the speed, and
+// whether playback is paused.
+static void
+main_play_status(float speed, bool paused)
 {
-        char buf[1024];
-        int pos;
-        snprintf(buf, sizeof buf, "%0.2f %0.2f %0.2f",
-                 load[0], load[1], load[2]);
-        pos = COLS - strlen(buf) - 8;
-        if (pos < 0)
-                pos = 0;
-        putp(tiparm(cursor_address, 0, pos));
-        putp(exit_attribute_mode);
-        putp(tiparm(set_a_foreground, COLOR_WHITE));
-        fputs("  load: ", stdout);
-        putp(exit_attribute_mode);
-        fputs(buf, stdout);
+        char buf[128], date[64];
+        time_t t = (play_start + play_time) / 1000000;
+        strftime(date, sizeof date, "%Y-%m-%d %H:%M:%S", localtime(&t));
+        unsigned secs = play_time / 1000000;
+        int len = snprintf(buf, sizeof buf, "replay %s +%u:%02u:%02u",
+                           date, secs / 3600, secs / 60 % 60, secs % 60);
+        if (speed)
+                len += snprintf(buf + len, sizeof buf - len, " x%g", speed);
+        else
+                len += snprintf(buf + len, sizeof buf - len, " fast");
+        if (play_eof)
+                snprintf(buf + len, sizeof buf - len, " (end)");
+        else if (paused)
+                snprintf(buf + len, sizeof buf - len, " (paused)");
+        ui_show_status(buf);
 }
 
-void
-ui_compute_bars(struct cpustats *delta)
+// Play back a recording at speed times real time (or as fast as
+// possible if speed is 0), starting seek seconds in.
+static void
+main_play(const char *path, float speed, float seek, bool force_ascii)
 {
-        if (!ui_ascii) {
-                // ui_display and ui_fore are only used in Unicode mode
-                memset(ui_display, 0, ui_bar_length * ui_bar_width);
-                memset(ui_fore, 0xff, ui_bar_length * ui_bar_width);
-        }
-        memset(ui_back, 0xff, ui_bar_length * ui_bar_width);
+        play_open(path);
+        term_init();
+        ui_init(force_ascii);
 
-        int i, bar;
-        for (bar = 0; bar < ui_num_bars; bar++) {
-                int barpos = ui_bars[bar].start;
-                struct cpustat *cpu = ui_bars[bar].cpu == -1 ? &delta->avg :
-                        &delta->cpus[ui_bars[bar].cpu];
-
-                // Calculate cut-offs between segments.  We divide
-                // each display cell into `subcells' steps so we can
-                // use integer math.
-                enum { subcells = 256 };
-                // Values in delta are from 0 to `scale'.  For per-CPU
-                // bars this is just the real time, but for the
-                // average bar, it's multiplied by the number of
-                // online CPU's.
-                int scale = delta->real;
-                if (ui_bars[bar].cpu == -1)
-                        scale *= delta->online;
-                // To simplify the code, we include one additional
-                // cutoff fixed at the very top of the bar so we can
-                // treat the empty region above the bar as a segment.
-                int cutoff[NSTATS + 1];
-                unsigned long long cumm = 0;
-                for (i = 0; i < NSTATS; i++) {
-                        cumm += *(unsigned long long*)
-                                ((char*)cpu + ui_stats[i].offset);
-                        cutoff[i] = cumm * ui_bar_length * subcells / scale;
-                }
-                cutoff[NSTATS] = ui_bar_length * subcells;
-
-                // Construct bar cells
-                int len, stat;
-                for (len = stat = 0; len < ui_bar_length && stat < NSTATS; len++) {
-                        int lo = len * subcells, hi = (len + 1) * subcells;
-                        if (cutoff[stat] >= hi) {
-                                // Cell is entirely covered
-                                UIXY(ui_back, barpos, len) =
-                                        ui_stats[stat].color;
-                                continue;
-                        }
+        struct cpustats *delta = cpustats_alloc(),
+                *layout = cpustats_alloc();
+        float loadavg[3];
+        bool have = play_seek(delta, loadavg, seek * 1000000);
+        if (!have)
+                panic("%s: nothing to play after %g seconds", path, seek);
+        bool first = true, paused = false;
+        // The wall-clock time at which we showed the record at
+        // base_time, which anchors the timing of the later records.
+        uint64_t base_wall = time_usec(), base_time = play_time;
+        uint64_t shown_time = play_time;
 
-                        // Find the two segments the cover this cell
-                        // the most
-                        int topStat[2] = {0, 0};
-                        int topVal[2] = {-1, -1};
-                        int val, prev = lo;
-                        for (; stat < NSTATS + 1; stat++) {
-                                val = MIN(cutoff[stat], hi) - prev;
-                                prev = cutoff[stat];
-                                if (val > topVal[0]) {
-                                        topStat[1] = topStat[0];
-                                        topVal[1] = topVal[0];
-                                        topStat[0] = stat;
-                                        topVal[0] = val;
-                                } else if (val > topVal[1]) {
-                                        topStat[1] = stat;
-                                        topVal[1] = val;
-                                }
-                                if (cutoff[stat] >= hi)
-                                        break;
+        while (!need_exit) {
+                if (have) {
+                        if (first || term_check_resize() ||
+                            !cpustats_sets_equal(delta, layout)) {
+                                ui_layout(delta);
+                                cpustats_copy_set(layout, delta);
+                                first = false;
                         }
-                        if (topVal[0] == -1 || topVal[1] == -1)
-                                panic("bug: topVal={%d,%d}",
-                                      topVal[0], topVal[1]);
-
-                        if (ui_ascii) {
-                                // We only care about the biggest
-                                // cover
-                                UIXY(ui_back, barpos, len) =
-                                        ui_stats[topStat[0]].color;
-                                continue;
+                        ui_show_load(loadavg);
+                        if (delta->real) {
+                                ui_compute_bars(delta);
+                                ui_show_bars(SIZE_MAX);
                         }
+                        shown_time = play_time;
+                }
 
-                        // Order the segments by stat so we put the
-                        // earlier stat on the bottom
-                        if (topStat[0] > topStat[1]) {
-                                SWAP(topStat[0], topStat[1]);
-                                SWAP(topVal[0], topVal[1]);
-                        }
+                // Get the next delta and wait until it's due.  If
+                // we've hit the end, just wait for input.
+                have = play_next(delta, loadavg);
+                while (!need_exit) {
+                        if (!first)
+                                main_play_status(speed, paused);
+                        out_flush();
 
-                        // Re-scale and choose a split
-                        int cell = topVal[0] * NCHARS / (topVal[0] + topVal[1]);
+                        int timeout = -1;
+                        if (have && !paused) {
+                                uint64_t due = base_wall;
+                                if (speed)
+                                        due += (uint64_t)((play_time - base_time) / speed);
+                                uint64_t now = time_usec();
+                                timeout = due > now ? (due - now + 999) / 1000 : 0;
+                        }
+                        struct pollfd pollfd = {
+                                .fd = 0,
+                                .events = POLLIN
+                        };
+                        if (poll(&pollfd, 1, timeout) < 0 && errno != EINTR)
+                                epanic("poll failed");
+                        if (!(pollfd.revents & POLLIN)) {
+                                if (timeout == 0)
+                                        break;
+                                continue;
+                        }
 
-                        // Fill the cell
-                        if (cell == NCHARS - 1) {
-                                // We leave this as a space, which
-                                // means the color roles are reversed
-                                UIXY(ui_back, barpos, len) =
-                                        ui_stats[topStat[0]].color;
+                        char ch = 0;
+                        if (read(0, &ch, 1) < 0)
+                                epanic("read failed");
+                        if (ch == 'q') {
+                                need_exit = 1;
+                        } else if (ch == ' ') {
+                                paused = !paused;
+                        } else if (ch == '<' || ch == '>') {
+                                // Seek ten seconds from what's shown
+                                uint64_t step = 10000000;
+                                uint64_t to = shown_time + step;
+                                if (ch == '<')
+                                        to = shown_time > step ?
+                                                shown_time - step : 0;
+                                have = play_seek(delta, loadavg, to);
                         } else {
-                                UIXY(ui_display, barpos, len) = cell;
-                                UIXY(ui_fore, barpos, len) =
-                                        ui_stats[topStat[0]].color;
-                                UIXY(ui_back, barpos, len) =
-                                        ui_stats[topStat[1]].color;
+                                continue;
                         }
-                }
 
-                // Copy across bar length
-                for (i = 1; i < ui_bars[bar].width; ++i) {
-                        memcpy(&UIXY(ui_display, barpos+i, 0),
-                               &UIXY(ui_display, barpos, 0), ui_bar_length);
-                        memcpy(&UIXY(ui_fore, barpos+i, 0),
-                               &UIXY(ui_fore, barpos, 0), ui_bar_length);
-                        memcpy(&UIXY(ui_back, barpos+i, 0),
-                               &UIXY(ui_back, barpos, 0), ui_bar_length);
+                        // Re-anchor timing to the next record
+                        base_wall = time_usec();
+                        base_time = play_time;
+                        if (ch != ' ')
+                                break;
                 }
         }
 }
 
+// The cost of the last tick, split by stage, for the overhead overlay
+static struct
+{
+        uint64_t read, compute, render, interval;
+        size_t bytes;
+        unsigned long syscalls;
+} main_cost;
+
+// Show the cost of the last update on the status line.  The times
+// come from the monotonic clock around each stage; syscalls counts
+// everything since the previous update, including waiting for input.
 static void
-ui_show_pane(struct ui_pane *pane)
+main_show_overhead(void)
 {
-        int row, col;
-        int lastBack = -1, lastFore = -1;
-        for (row = 0; row < ui_bar_length; row++) {
-                putp(tiparm(cursor_address, LINES - pane->start - row - 1, 0));
+        char buf[128];
+        snprintf(buf, sizeof buf, "read %lluus  bars %lluus  render %lluus  "
+                 "%zu bytes  %lu syscalls  every %.1fs",
+                 (unsigned long long)main_cost.read,
+                 (unsigned long long)main_cost.compute,
+                 (unsigned long long)main_cost.render,
+                 main_cost.bytes, main_cost.syscalls,
+                 main_cost.interval / 1e6);
+        ui_show_status(buf);
+}
 
-                // What's the width of this row?  Beyond this, we can
-                // just clear the line.
-                int endCol = 0;
-                for (col = pane->barpos; col < pane->barpos + pane->width;
-                     col++) {
-                        if (UIXY(ui_back, col, row) != 0xff ||
-                            UIXY(ui_display, col, row) != 0)
-                                endCol = col + 1;
-                }
+// The live display's current view of the statistics, its busiest
+// entries, and the view the screen was last laid out for
+static struct cpustats *main_view, *main_busy_view, *main_layout;
+// With busy only, just the main_busy busiest bars are shown
+static bool main_busy_only;
+static int main_busy = 16;
+static bool main_overhead, main_history, main_procs;
+// The number of lines the pressure line takes below the status line
+static int main_pressure;
+// Whether a sampler thread reads the statistics (-T)
+static bool main_sampler;
 
-                for (col = pane->barpos; col < endCol; col++) {
-                        int cell = UIXY(ui_display, col, row);
-                        int back = UIXY(ui_back, col, row);
-                        int fore = UIXY(ui_fore, col, row);
+// The number of lines of the process pane, including its heading
+#define MAIN_PROC_LINES 6
 
-                        // If it's a space, we don't care what the
-                        // foreground color is.
-                        if (ui_chars[cell][0] == ' ' && lastFore != -1)
-                                fore = lastFore;
+// Put the pressure line and the process pane, if they're on, between
+// the status line and the bars.
+static void
+main_set_top_lines(void)
+{
+        ui_top_lines = 2 + main_pressure + (main_procs ? MAIN_PROC_LINES : 0);
+}
 
-                        // Set attributes
-                        if (lastBack != back || lastFore != fore) {
-                                if (back == 0xff || fore == 0xff) {
-                                        putp(exit_attribute_mode);
-                                        lastBack = lastFore = 0xff;
-                                }
-                                if (lastBack != back) {
-                                        putp(tiparm(set_a_background, back));
-                                        lastBack = back;
-                                }
-                                if (lastFore != fore) {
-                                        putp(tiparm(set_a_foreground, fore));
-                                        lastFore = fore;
-                                }
-                        }
+static void
+main_show_pressure(void)
+{
+        float some[3], full[3];
+        char buf[128] = "cpu pressure: not reported by this kernel";
+        if (main_sampler ? sampler_pressure(some, full) :
+            cpustats_pressure(some, full)) {
+                int len = snprintf(buf, sizeof buf, "cpu pressure  "
+                                   "some %.2f%% %.2f%% %.2f%%",
+                                   some[0], some[1], some[2]);
+                if (full[0] >= 0)
+                        snprintf(buf + len, sizeof buf - len,
+                                 "  full %.2f%% %.2f%% %.2f%%",
+                                 full[0], full[1], full[2]);
+        }
+        ui_show_line(2, buf);
+}
 
-                        fputs(ui_chars[cell], stdout);
-                }
+// Show the busiest threads in the process pane.  When we've drilled
+// into a group, only threads that last ran in it count.
+static void
+main_show_procs(void)
+{
+        int top[MAIN_PROC_LINES - 1], ntop = 0, i, j;
+        const int *group = topo_group[topo_level];
+        for (i = 0; i < proc_ntasks; i++) {
+                const struct proc_task *task = &proc_tasks[i];
+                if (task->tid < 0 || task->rate <= 0)
+                        continue;
+                if (topo_only >= 0 && (task->cpu < 0 ||
+                                       task->cpu >= cpustats_cpus ||
+                                       group[task->cpu] != topo_only))
+                        continue;
+                if (ntop == MAIN_PROC_LINES - 1 &&
+                    task->rate <= proc_tasks[top[ntop - 1]].rate)
+                        continue;
+                j = MIN(ntop, MAIN_PROC_LINES - 2);
+                for (; j > 0 && proc_tasks[top[j - 1]].rate < task->rate; j--)
+                        top[j] = top[j - 1];
+                top[j] = i;
+                ntop = MIN(ntop + 1, MAIN_PROC_LINES - 1);
+        }
 
-                // Clear to the end of the line
-                if (endCol < pane->barpos + pane->width) {
-                        if (lastBack != 0xff || lastFore != 0xff) {
-                                putp(exit_attribute_mode);
-                                lastBack = lastFore = 0xff;
-                        }
-                        putp(clr_eol);
+        int y = 2 + main_pressure;
+        ui_show_line(y, "    TID   %CPU  CPU  COMMAND");
+        for (i = 0; i < MAIN_PROC_LINES - 1; i++) {
+                char buf[64] = "";
+                if (i < ntop) {
+                        const struct proc_task *task = &proc_tasks[top[i]];
+                        snprintf(buf, sizeof buf, "%7d %5.1f%% %4d  %s",
+                                 task->tid, task->rate / 10.0, task->cpu,
+                                 task->comm);
                 }
+                ui_show_line(y + 1 + i, buf);
         }
 }
 
-void
-ui_show_bars(void)
+// With -b, output is limited to main_rate bytes per second.
+// main_tokens is how many bytes we may send now, which builds up to
+// at most a second's worth and goes negative after a frame that
+// overran it.
+static long long main_rate, main_tokens;
+static uint64_t main_tokens_time;
+
+// Return whether to send a frame now.  That needs both the budget and
+// room in the terminal's output buffer, since frames queued behind a
+// slow link are only stale by the time they arrive.
+static bool
+main_may_send(void)
 {
-        int pane;
-        for (pane = 0; pane < ui_num_panes; ++pane)
-                ui_show_pane(&ui_panes[pane]);
+        uint64_t now = time_usec();
+        main_tokens = MIN(main_tokens + (long long)
+                          ((now - main_tokens_time) * main_rate / 1000000),
+                          main_rate);
+        main_tokens_time = now;
+        if (main_tokens <= 0)
+                return false;
+        struct pollfd pollfd = {
+                .fd = out_fd,
+                .events = POLLOUT
+        };
+        sys_calls++;
+        return poll(&pollfd, 1, 0) > 0 && (pollfd.revents & POLLOUT);
 }
 
-/******************************************************************
- * Main
- */
+// Describe the live display's view for the status line.
+static const char *
+main_describe(void)
+{
+        static char buf[96];
+        if (!main_busy_only)
+                return topo_describe();
+        const char *topo = topo_describe();
+        snprintf(buf, sizeof buf, "%s%sbusiest %d", topo, *topo ? ", " : "",
+                 main_busy);
+        return buf;
+}
 
-static sig_atomic_t need_exit;
+// Show a new sample in the live display, or, if `redraw' is set,
+// show the last sample again from scratch.  The layout is also
+// recomputed if the terminal was resized or the set of bars changed.
+// Returns how far the bars moved, as for ui_compute_bars.
+static int
+main_show(struct cpustats *delta, float loadavg[3], bool redraw)
+{
+        struct cpustats *view = delta;
+        if (topo_level != TOPO_CPU) {
+                topo_view(main_view, delta);
+                view = main_view;
+        }
+        if (main_busy_only) {
+                busy_view(main_busy_view, view, main_busy);
+                view = main_busy_view;
+        }
+        bool resized = term_check_resize();
+        int moved = 0;
+        if (!redraw) {
+                int changed = hist_add(view);
+                if (main_history)
+                        moved = changed;
+        }
+        if (main_history) {
+                // Unlike the bars, the history goes before the rest
+                // of the frame, since drawing it from scratch clears
+                // the screen
+                size_t budget = SIZE_MAX;
+                if (main_rate)
+                        budget = MAX(main_tokens - (long long)out_len, 0LL);
+                hist_show(redraw || resized, budget);
+        } else {
+                hist_shown = false;
+                if (redraw || resized ||
+                    !cpustats_sets_equal(view, main_layout)) {
+                        ui_layout(view);
+                        cpustats_copy_set(main_layout, view);
+                }
+        }
 
-void
-on_sigint(int sig)
+        ui_show_load(loadavg);
+
+        if (main_pressure)
+                main_show_pressure();
+        if (main_procs)
+                main_show_procs();
+
+        main_cost.compute = 0;
+        if (view->real && !main_history) {
+                uint64_t start = time_usec();
+                moved = ui_compute_bars(view);
+                main_cost.compute = time_usec() - start;
+                // Leave the bars what's left of the budget after
+                // the rest of the frame
+                size_t budget = SIZE_MAX;
+                if (main_rate)
+                        budget = MAX(main_tokens - (long long)out_len, 0LL);
+                ui_show_bars(budget);
+        }
+
+        if (main_overhead)
+                main_show_overhead();
+        else
+                ui_show_status(main_describe());
+
+        // Done updating UI
+        out_flush();
+        if (main_rate)
+                main_tokens -= out_frame_bytes;
+        return moved;
+}
+
+// Handle a key in the live display.  Return true if the view changed.
+static bool
+main_key(char ch)
 {
-        need_exit = 1;
+        switch (ch) {
+        case 'o':
+                main_overhead = !main_overhead;
+                return true;
+        case 'h':
+                main_history = !main_history;
+                return true;
+        case 'p':
+                // The thread list comes from procfs, which the
+                // sysctl source does without
+                if (!proc_path)
+                        return false;
+                // Make room for the process pane above the bars
+                if ((main_procs = !main_procs)) {
+                        proc_init();
+                        proc_update();
+                }
+                main_set_top_lines();
+                return true;
+        case 'k':
+                main_busy_only = !main_busy_only;
+                return true;
+        case 'P':
+                main_pressure = !main_pressure;
+                main_set_top_lines();
+                return true;
+        case 'g':
+                // Cycle through the aggregation levels
+                topo_level = (topo_level + 1) % NTOPO;
+                topo_only = -1;
+                return true;
+        case 'd':
+                // Drill into a group, or back out
+                if (topo_level == TOPO_CPU)
+                        return false;
+                topo_only = topo_only < 0 ? 0 : -1;
+                return true;
+        case '[':
+        case ']':
+                // Move to the previous or next group
+                if (topo_only < 0)
+                        return false;
+                topo_only = (topo_only + (ch == '[' ? -1 : 1) +
+                             topo_ngroups[topo_level]) %
+                        topo_ngroups[topo_level];
+                return true;
+        }
+        return false;
 }
 
+// The names -o takes, indexed by stream_format
+static const char *stream_names[] = {NULL, "json", "csv", "none"};
+
 int
 main(int argc, char **argv)
 {
         bool force_ascii = false;
-        int delay = 500;
+        int delay = 500, adapt = 0, sampler_cpu = -1, subs = 1;
+        const char *source = NULL, *record = NULL, *play = NULL;
+        const char *shm = NULL;
+        const char *listen_addr = NULL, **connect_addrs = NULL;
+        int nconnect = 0;
+        float speed = 1, seek = 0;
+        enum stream_format stream = STREAM_NONE;
 
         int opt;
-        while ((opt = getopt(argc, argv, "ad:h")) != -1) {
+        while ((opt = getopt(argc, argv, "aA:b:C:d:g:k:m:o:s:T:u:w:r:S:t:l:c:h")) != -1) {
                 switch (opt) {
                 case 'a':
                         force_ascii = true;
                         break;
                 case 'd':
+                case 'A':
                 {
                         char *end;
                         float val = strtof(optarg, &end);
                         if (*end) {
-                                fprintf(stderr, "Delay argument (-d) requires "
-                                        "a number\n");
+                                fprintf(stderr, "%s argument (-%c) requires "
+                                        "a number\n",
+                                        opt == 'd' ? "Delay" : "Adaptive delay",
+                                        opt);
+                                exit(2);
+                        }
+                        if (opt == 'd')
+                                delay = 1000 * val;
+                        else
+                                adapt = 1000 * val;
+                        break;
+                }
+                case 'g':
+                        for (topo_level = 0; topo_level < NTOPO; topo_level++)
+                                if (strcmp(optarg, topo_names[topo_level]) == 0)
+                                        break;
+                        if (topo_level == NTOPO) {
+                                fprintf(stderr, "Group argument (-g) must be "
+                                        "cpu, core, socket, or node\n");
+                                exit(2);
+                        }
+                        break;
+                case 'k':
+                {
+                        char *end;
+                        main_busy = strtol(optarg, &end, 10);
+                        if (*end || main_busy <= 0) {
+                                fprintf(stderr, "Busy argument (-k) requires "
+                                        "a positive number\n");
+                                exit(2);
+                        }
+                        main_busy_only = true;
+                        break;
+                }
+                case 'm':
+                        shm = optarg;
+                        break;
+                case 'T':
+                {
+                        char *end;
+                        main_sampler = true;
+                        if (strcmp(optarg, "any") == 0)
+                                break;
+                        sampler_cpu = strtol(optarg, &end, 10);
+                        if (*end || sampler_cpu < 0) {
+                                fprintf(stderr, "Sampler argument (-T) "
+                                        "requires a cpu number or any\n");
+                                exit(2);
+                        }
+                        break;
+                }
+                case 'u':
+                {
+                        char *end;
+                        subs = strtol(optarg, &end, 10);
+                        if (*end || subs <= 0 || subs > 1000) {
+                                fprintf(stderr, "Samples argument (-u) "
+                                        "requires a number from 1 to "
+                                        "1000\n");
+                                exit(2);
+                        }
+                        main_sampler = true;
+                        break;
+                }
+                case 'o':
+                        for (stream = STREAM_JSON; stream <= STREAM_QUIET;
+                             stream++)
+                                if (strcmp(optarg, stream_names[stream]) == 0)
+                                        break;
+                        if (stream > STREAM_QUIET) {
+                                fprintf(stderr, "Output argument (-o) must "
+                                        "be json, csv, or none\n");
+                                exit(2);
+                        }
+                        break;
+                case 's':
+                        source = optarg;
+                        break;
+                case 'C':
+                        cpustats_cgroup = optarg;
+                        source = "cgroup";
+                        break;
+                case 'w':
+                        record = optarg;
+                        break;
+                case 'r':
+                        play = optarg;
+                        break;
+                case 'l':
+                        listen_addr = optarg;
+                        break;
+                case 'c':
+                        if (!connect_addrs &&
+                            !(connect_addrs = malloc(argc * sizeof *connect_addrs)))
+                                epanic("allocating addresses");
+                        connect_addrs[nconnect++] = optarg;
+                        break;
+                case 'b':
+                {
+                        char *end;
+                        main_rate = strtoll(optarg, &end, 10);
+                        if (*end || main_rate <= 0) {
+                                fprintf(stderr, "Rate argument (-b) requires "
+                                        "a positive number\n");
+                                exit(2);
+                        }
+                        main_tokens = main_rate;
+                        break;
+                }
+                case 'S':
+                case 't':
+                {
+                        char *end;
+                        float val = strtof(optarg, &end);
+                        if (*end || val < 0) {
+                                fprintf(stderr, "-%c requires a non-negative "
+                                        "number\n", opt);
                                 exit(2);
                         }
-                        delay = 1000 * val;
+                        if (opt == 'S')
+                                speed = val;
+                        else
+                                seek = val;
                         break;
                 }
                 default:
-                        fprintf(stderr, "Usage: %s [-a] [-d delay]\n", argv[0]);
+                        fprintf(stderr, "Usage: %s [-a] [-d delay] [-A delay] [-b rate] [-g level] [-k count]\n"
+                                "       %*s [-s source] [-C cgroup] [-m name] [-w file | -o format]\n"
+                                "       %s [-a] -r file [-S speed] [-t secs]\n"
+                                "       %s [-d delay] [-s source] -l [host:]port\n"
+                                "       %s [-a] [-d delay] -c host:port [-c host:port]...\n",
+                                argv[0], (int)strlen(argv[0]), "",
+                                argv[0], argv[0], argv[0]);
                         if (opt == 'h') {
                                 fprintf(stderr,
                                         "\n"
@@ -957,6 +6137,60 @@ main(int argc, char **argv)
                                         "Options:\n"
                                         "  -a       Use ASCII-only bars (instead of Unicode)\n"
                                         "  -d SECS  Specify delay between updates (decimals accepted)\n"
+                                        "  -A SECS  Adapt the delay: while the bars hold still, back off to\n"
+                                        "           as slow as one update every SECS, and return to -d\n"
+                                        "           as soon as they move\n"
+                                        "  -b RATE  Send at most RATE bytes per second to the terminal, for\n"
+                                        "           slow links.  Frames the link can't take are merged\n"
+                                        "           into later ones, and a frame that doesn't fit updates\n"
+                                        "           only the average bar and the bars that changed most\n"
+                                        "  -g LVL   Show one bar per core, socket, or node instead of per cpu\n"
+                                        "  -k N     Only show bars for the N busiest cpus (or groups)\n"
+                                        "  -s SRC   Read CPU statistics from SRC, one of:\n"
+#ifdef __FreeBSD__
+                                        "             sysctl     kern.cp_times (default)\n"
+                                        "             stat       /proc/stat, from linprocfs\n"
+#else
+                                        "             stat       /proc/stat (default)\n"
+#endif
+                                        "             cgroup     The CPU time of the cgroup given by -C\n"
+                                        "  -T CPU   Read the statistics in a thread of their own, pinned to\n"
+                                        "           CPU (or any), so a slow terminal doesn't delay them\n"
+                                        "  -u N     Sample N times per update (in a thread, as with -T), and\n"
+                                        "           mark the peak and 95th percentile of each cpu over them\n"
+                                        "  -C PATH  Show the CPU time of the cgroup at PATH (absolute, or\n"
+                                        "           relative to /sys/fs/cgroup), with the average bar\n"
+                                        "           scaled to its CPU quota.  cgroup v2 only reports\n"
+                                        "           the total, so there are no per-cpu bars\n"
+                                        "  -w FILE  Record statistics to FILE (- for stdout) instead of\n"
+                                        "           displaying them\n"
+                                        "  -o FMT   Write each update's percentages to stdout as json\n"
+                                        "           (one object per line) or csv instead of displaying\n"
+                                        "           them, or with none, just sample them (for -m)\n"
+                                        "  -m NAME  Also publish every sample to shared memory NAME (in\n"
+                                        "           /dev/shm on Linux) for other processes to read\n"
+                                        "  -r FILE  Play back a recording made with -w\n"
+                                        "  -S X     Play back at X times real time (0 for as fast as possible)\n"
+                                        "  -t SECS  Start playing back SECS seconds into the recording\n"
+                                        "  -l ADDR  Serve statistics to clients on [HOST:]PORT instead of\n"
+                                        "           displaying them\n"
+                                        "  -c ADDR  Display statistics from a server at HOST:PORT.  With\n"
+                                        "           several -c options, show each host's CPU's as a group\n"
+                                        "           of bars\n"
+                                        "\n"
+                                        "While running, o toggles a line showing cpubars' own cost per update,\n"
+                                        "g cycles through the -g levels, d shows the CPU's of one core, socket,\n"
+                                        "or node (or goes back), and [ and ] move between them.  h switches\n"
+                                        "between the bars and a strip chart of their recent history.  p shows\n"
+                                        "the threads using the most CPU (of the CPU's shown, after d).  That\n"
+                                        "costs a stat file read for each of up to 1024 threads per update, plus\n"
+                                        "a walk of every /proc/*/task every 5 seconds, which adds up on hosts\n"
+                                        "with many threads.  P shows how much of the time tasks were stalled\n"
+                                        "waiting for a CPU.  k switches between all bars and only the busiest\n"
+                                        "(16, or as set by -k).\n"
+                                        "During playback, space pauses, and < and > seek 10 seconds.\n"
+                                        "With several -c hosts, d shows the CPU's of one host (or goes back),\n"
+                                        "and [ and ] move between hosts.\n"
                                         "\n"
                                         "If your bars look funky, use -a or specify LANG=C.\n"
                                         "\n"
@@ -976,60 +6210,694 @@ main(int argc, char **argv)
                 .sa_handler = on_sigint
         };
         sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
 
-        cpustats_init();
+        if (main_sampler && (record || listen_addr || stream || play ||
+                             nconnect)) {
+                // Only the live display has a sampler thread
+                fprintf(stderr, "-T and -u can't be used with -w, -l, -o, "
+                        "-r, or -c\n");
+                exit(2);
+        }
+        if (play) {
+                main_play(play, speed, seek, force_ascii);
+                return 0;
+        }
+        if (nconnect) {
+                main_client(connect_addrs, nconnect, delay, force_ascii);
+                return 0;
+        }
+        if (cpustats_cgroup && (record || listen_addr)) {
+                // Recordings don't carry the quota the average is
+                // scaled to
+                fprintf(stderr, "-C can't be used with -w or -l\n");
+                exit(2);
+        }
+        cpustats_init(source);
+        if (shm)
+                shm_init(shm);
+        if (record) {
+                main_record(record, delay);
+                return 0;
+        }
+        if (listen_addr) {
+                main_serve(listen_addr, delay);
+                return 0;
+        }
+        if (stream) {
+                main_stream(stream, delay);
+                return 0;
+        }
         term_init();
         ui_init(force_ascii);
+        hist_init();
 
-        struct cpustats *before = cpustats_alloc(),
-                *after = cpustats_alloc(),
-                *delta = cpustats_alloc(),
-                *prevLayout = cpustats_alloc();
+        topo_init();
+        main_view = cpustats_alloc();
+        main_busy_view = cpustats_alloc();
+        main_layout = cpustats_alloc();
 
-        cpustats_read(before);
-        cpustats_subtract(prevLayout, before, before);
-        ui_layout(prevLayout);
-        fflush(stdout);
+        // As in main_record, each snapshot is read over the last
+        // delta and the previous snapshot becomes the new delta.
+        struct cpustats *snap = cpustats_alloc(), *delta = cpustats_alloc();
+
+        float loadavg[3];
+        int runnable;
+        if (main_sampler) {
+                sampler_start(delay, sampler_cpu, subs);
+                runnable = sampler_take(snap, loadavg);
+        } else {
+                cpustats_read(snap);
+                runnable = cpustats_loadavg(loadavg);
+        }
+        cpustats_copy(delta, snap);
+        cpustats_delta(delta, snap);
+        main_show(delta, loadavg, true);
+        struct tick tick;
+        tick_init(&tick, delay * 1000);
+        unsigned long last_calls = sys_calls;
+        uint64_t last_update = time_usec();
+        // With -A, a full update happens only every backoff ticks
+        int backoff = 1, max_backoff = MAX(adapt / MAX(delay, 1), 1);
+        int ticks = 0;
         while (!need_exit) {
-                // Sleep or take input
-                struct pollfd pollfd = {
-                        .fd = 0,
-                        .events = POLLIN
-                };
-                if (poll(&pollfd, 1, delay) < 0 && errno != EINTR)
-                        epanic("poll failed");
-                if (pollfd.revents & POLLIN) {
-                        char ch = 0;
-                        if (read(0, &ch, 1) < 0)
-                                epanic("read failed");
-                        if (ch == 'q')
-                                break;
+                // Take input until the next tick is due.  With a
+                // sampler, the next tick is its next sample.
+                int timeout = main_sampler ? -1 : tick_timeout(&tick);
+                if (timeout != 0) {
+                        struct pollfd pollfd[2] = {
+                                {.fd = 0, .events = POLLIN},
+                                {.fd = sampler_wake[0], .events = POLLIN}
+                        };
+                        if (poll(pollfd, 1 + main_sampler, timeout) < 0 &&
+                            errno != EINTR)
+                                epanic("poll failed");
+                        sys_calls++;
+                        bool redraw = false;
+                        if (pollfd[0].revents & POLLIN) {
+                                char ch = 0;
+                                if (read(0, &ch, 1) < 0)
+                                        epanic("read failed");
+                                sys_calls++;
+                                if (ch == 'q')
+                                        break;
+                                redraw = main_key(ch);
+                        }
+                        // Redraw the last sample right away on resize
+                        // or a change of view, rather than waiting for
+                        // the next tick
+                        if (term_check_resize() || redraw)
+                                main_show(delta, loadavg, true);
+                        // Empty the pipe before anything below can skip
+                        // this sample, or poll would keep returning
+                        if (!(main_sampler && pollfd[1].revents & POLLIN))
+                                continue;
+                        sampler_drain();
+                } else {
+                        tick_advance(&tick);
+                }
+
+                // While we can't send, skip whole ticks.  Not reading
+                // the statistics (or not taking the sampler's) merges
+                // the skipped ticks into the delta of the next frame.
+                if (main_rate && !main_may_send())
+                        continue;
+
+                // The ticks between full updates only check the
+                // number of runnable tasks, so a sudden burst of load
+                // cuts the wait short
+                if (++ticks < backoff) {
+                        float probe[3];
+                        int now = main_sampler ? sampler_runnable() :
+                                cpustats_loadavg(probe);
+                        if (abs(now - runnable) <= delta->online / 8 + 1)
+                                continue;
                 }
+                ticks = 0;
 
                 // Get new statistics
-                cpustats_read(after);
-                cpustats_subtract(delta, after, before);
+                uint64_t start = time_usec();
+                main_cost.syscalls = sys_calls - last_calls;
+                last_calls = sys_calls;
+                main_cost.interval = start - last_update;
+                last_update = start;
+                if (main_sampler) {
+                        // The sampler publishes to shared memory itself
+                        runnable = sampler_take(delta, loadavg);
+                        cpustats_delta(snap, delta);
+                        SWAP(snap, delta);
+                        sampler_mark(delta);
+                } else {
+                        cpustats_read(delta);
+                        cpustats_delta(snap, delta);
+                        SWAP(snap, delta);
+                        runnable = cpustats_loadavg(loadavg);
+                        shm_publish(snap, delta, loadavg);
+                }
+                if (main_procs)
+                        proc_update();
+                uint64_t read_done = time_usec();
 
-                // Recompute the layout if necessary
-                if (term_check_resize() || !cpustats_sets_equal(delta, prevLayout))
-                        ui_layout(delta);
+                // Back off while the bars hold still, and go back to
+                // every tick as soon as they move
+                int moved = main_show(delta, loadavg, false);
+                if (adapt)
+                        backoff = moved ? 1 : MIN(2 * backoff, max_backoff);
+                main_cost.read = read_done - start;
+                main_cost.render = time_usec() - read_done - main_cost.compute;
+                main_cost.bytes = out_frame_bytes;
+        }
 
-                // Show the load average
-                float loadavg[3];
-                cpustats_loadavg(loadavg);
-                ui_show_load(loadavg);
+        return 0;
+}
+#endif // CPUBARS_BENCH
+
+#ifdef CPUBARS_BENCH
+/******************************************************************
+ * Benchmark
+ */
+
+// Built by "make bench" in place of the usual main.  For each CPU
+// count, this writes a synthetic procfs with a /proc/stat for that
+// many CPU's, and times each stage of turning it into a frame.  The
+// frames go to a terminal that discards them, so only cpubars' own
+// cost is measured.  With -p, it instead times the stat parser
+// against the sscanf one it replaced, over a /proc/stat on disk such
+// as bench/stat-1024.  Building it with -DCPUBARS_SCALAR as well
+// times the per-bar division the cutoff scaling used to do, and -c
+// checks that the two scalings agree.
+
+// The interval each synthetic snapshot covers, in clock ticks
+#define BENCH_TICKS 50
 
-                if (delta->real) {
-                        ui_compute_bars(delta);
-                        ui_show_bars();
+static uint64_t
+bench_nsec(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t bench_seed = 1;
+
+static uint32_t
+bench_rand(void)
+{
+        // xorshift32
+        bench_seed ^= bench_seed << 13;
+        bench_seed ^= bench_seed >> 17;
+        bench_seed ^= bench_seed << 5;
+        return bench_seed;
+}
+
+static void
+bench_sink(const char *buf, size_t len)
+{
+}
+
+// Advance the counters of ncpus CPU's by one interval of random
+// load, and write the resulting /proc/stat to fd.  Returns the size
+// of the file.
+static size_t
+bench_write_stat(int fd, unsigned long long *counters, int ncpus)
+{
+        static char *buf;
+        static size_t cap;
+        size_t need = (ncpus + 1) * 256 + 4096;
+        if (need > cap) {
+                free(buf);
+                cap = need;
+                if (!(buf = malloc(cap)))
+                        epanic("allocating benchmark stat");
+        }
+
+        // Each CPU spends a random share of the interval busy, and
+        // splits that at random between user through steal
+        unsigned long long *total = counters + ncpus * NCOLUMNS;
+        int cpu, col;
+        memset(total, 0, NCOLUMNS * sizeof *total);
+        for (cpu = 0; cpu < ncpus; cpu++) {
+                unsigned long long *c = counters + cpu * NCOLUMNS;
+                int left = BENCH_TICKS;
+                for (col = 0; col < 8; col++) {
+                        int n = col == 3 ? 0 : bench_rand() % (left + 1);
+                        c[col] += n;
+                        left -= n;
                 }
+                // The rest is idle
+                c[3] += left;
+                for (col = 0; col < NCOLUMNS; col++)
+                        total[col] += c[col];
+        }
 
-                // Done updating UI
-                fflush(stdout);
+        size_t len = 0;
+        for (cpu = -1; cpu < ncpus; cpu++) {
+                unsigned long long *c = cpu < 0 ? total :
+                        counters + cpu * NCOLUMNS;
+                if (cpu < 0)
+                        len += sprintf(buf + len, "cpu ");
+                else
+                        len += sprintf(buf + len, "cpu%d", cpu);
+                for (col = 0; col < NCOLUMNS; col++)
+                        len += sprintf(buf + len, " %llu", c[col]);
+                buf[len++] = '\n';
+        }
+        len += sprintf(buf + len, "intr 123456789");
+        for (col = 0; col < 256; col++)
+                len += sprintf(buf + len, " %d", col);
+        len += sprintf(buf + len, "\nctxt 987654321\nbtime 1\n"
+                       "processes 4242\nprocs_running 1\nprocs_blocked 0\n");
+
+        if (pwrite(fd, buf, len, 0) != len || ftruncate(fd, len) < 0)
+                epanic("failed to write benchmark stat");
+        return len;
+}
+
+static void
+bench_run(int ncpus, int frames, int rows, int cols, bool force_ascii,
+          int busy)
+{
+        char dir[] = "/tmp/cpubars-bench.XXXXXX", path[PATH_MAX];
+        if (!mkdtemp(dir))
+                epanic("failed to create %s", dir);
+        snprintf(path, sizeof path, "%s/loadavg", dir);
+        FILE *fp = fopen(path, "w");
+        if (!fp || fputs("0.50 0.40 0.30 1/100 4242\n", fp) < 0 ||
+            fclose(fp))
+                epanic("failed to write %s", path);
+        char stat_path[PATH_MAX];
+        snprintf(stat_path, sizeof stat_path, "%s/stat", dir);
+        int fd = open(stat_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+                epanic("failed to create %s", stat_path);
+        unsigned long long *counters =
+                calloc((ncpus + 1) * NCOLUMNS, sizeof *counters);
+        if (!counters)
+                epanic("allocating benchmark counters");
+        bench_write_stat(fd, counters, ncpus);
+
+        proc_path = dir;
+        cpustats_cpus = ncpus;
+        cpustats_init("stat");
+
+        // A terminal of the requested size that discards everything
+        char num[16];
+        snprintf(num, sizeof num, "%d", rows);
+        setenv("LINES", num, 1);
+        snprintf(num, sizeof num, "%d", cols);
+        setenv("COLUMNS", num, 1);
+        const char *term = getenv("TERM");
+        int null_fd = open("/dev/null", O_WRONLY), err;
+        if (setupterm(term ? term : "xterm", null_fd, &err) != OK)
+                panic("failed to set up terminal %s", term ? term : "xterm");
+        term_cache_strings();
+        out_sink = bench_sink;
+        ui_init(force_ascii);
+
+        struct cpustats *snap = cpustats_alloc(), *delta = cpustats_alloc();
+        struct cpustats *busy_delta = cpustats_alloc();
+        struct cpustats *layout = cpustats_alloc();
+        cpustats_read(snap);
+        cpustats_copy(delta, snap);
+        cpustats_delta(delta, snap);
+        ui_layout(delta);
+        cpustats_copy_set(layout, delta);
+        out_flush();
+
+        uint64_t ns[4] = {0};
+        unsigned long long in_bytes = 0, out_bytes = 0;
+        int frame;
+        for (frame = 0; frame < frames; frame++) {
+                in_bytes += bench_write_stat(fd, counters, ncpus);
+
+                uint64_t t0 = bench_nsec();
+                cpustats_read(delta);
+                uint64_t t1 = bench_nsec();
+                cpustats_delta(snap, delta);
+                SWAP(snap, delta);
+                // The snapshots are read back to back, so use the
+                // interval they were written for
+                delta->real = BENCH_TICKS;
+                uint64_t t2 = bench_nsec();
+                // With -k, picking the busiest CPU's (and laying them
+                // out when they change) counts towards compute
+                struct cpustats *view = delta;
+                if (busy) {
+                        busy_view(busy_delta, delta, busy);
+                        view = busy_delta;
+                        if (!cpustats_sets_equal(view, layout)) {
+                                ui_layout(view);
+                                cpustats_copy_set(layout, view);
+                        }
+                }
+                ui_compute_bars(view);
+                uint64_t t3 = bench_nsec();
+                ui_show_bars(SIZE_MAX);
+                out_flush();
+                uint64_t t4 = bench_nsec();
+
+                ns[0] += t1 - t0;
+                ns[1] += t2 - t1;
+                ns[2] += t3 - t2;
+                ns[3] += t4 - t3;
+                out_bytes += out_frame_bytes;
+        }
+
+        printf("%5d %10.0f %8.0f %8.0f %10.0f %8.0f %10.0f %8.0f\n", ncpus,
+               (double)ns[0] / frames, (double)in_bytes / frames,
+               (double)ns[1] / frames, (double)ns[2] / frames,
+               (double)ns[3] / frames, (double)out_bytes / frames,
+               (double)(ns[0] + ns[1] + ns[2] + ns[3]) / frames);
+
+        unlink(stat_path);
+        unlink(path);
+        rmdir(dir);
+}
+
+// The sscanf parser that cpustats_parse_stat replaced, which -p
+// times it against.
+static void
+bench_sscanf_stat(struct cpustats *out, char *pos)
+{
+        while (strncmp(pos, "cpu", 3) == 0) {
+                pos += 3;
+
+                int cpu = -1;
+                if (*pos == ' ') {
+                        // Aggregate line
+                } else if (isdigit(*pos)) {
+                        cpu = strtol(pos, &pos, 10);
+                        if (cpu >= cpustats_cpus)
+                                goto next;
+                } else {
+                        goto next;
+                }
+
+                unsigned long long c[NCOLUMNS] = {0};
+                int col;
+                if (sscanf(pos, " %llu %llu %llu %llu %llu %llu %llu %llu "
+                           "%llu %llu", &c[0], &c[1], &c[2], &c[3], &c[4],
+                           &c[5], &c[6], &c[7], &c[8], &c[9]) < 4)
+                        goto next;
+                for (col = 0; col < NCOLUMNS; col++)
+                        if (cpustats_columns[col] != -1)
+                                out->field[cpustats_columns[col]][cpu] =
+                                        c[col];
+                CPUSTAT(out, user, cpu) -= MIN(CPUSTAT(out, guest, cpu),
+                                               CPUSTAT(out, user, cpu));
+                if (cpu != -1) {
+                        cpustats_set_online(out, cpu);
+                        out->online++;
+                }
+                if (cpu > out->max)
+                        out->max = cpu;
+
+        next:
+                while (*pos && *pos != '\n')
+                        pos++;
+                if (*pos) pos++;
+        }
+}
+
+// Time parse over stat, frames times, and return the ns per parse.
+static double
+bench_parse_one(void (*parse)(struct cpustats *, char *),
+                struct cpustats *out, char *stat, int frames)
+{
+        uint64_t start = bench_nsec();
+        int frame;
+        for (frame = 0; frame < frames; frame++) {
+                cpustats_clear(out);
+                parse(out, stat);
+        }
+        return (double)(bench_nsec() - start) / frames;
+}
+
+// Where bench_cutoffs_one leaves a result, so its loop isn't dropped
+static volatile uint64_t bench_cutoffs_sum;
+
+// Time n bars of NSTATS cutoffs through ui_scale_cutoffs, or the
+// division it replaced if scalar is set, in ns per frame.  Like
+// ui_gather_bar, ui_scale_cutoffs takes a reciprocal of each scale
+// every frame, so that counts too.
+static double
+bench_cutoffs_one(int n, bool scalar, int frames)
+{
+        uint32_t *cumm = malloc(NSTATS * n * sizeof *cumm);
+        uint32_t *out = malloc(NSTATS * n * sizeof *out);
+        uint32_t *scale = malloc(n * sizeof *scale);
+        uint32_t *rint = malloc(n * sizeof *rint);
+        uint32_t *rfrac = malloc(n * sizeof *rfrac);
+        if (!cumm || !out || !scale || !rint || !rfrac)
+                epanic("allocating benchmark cutoffs");
+        const uint32_t total = 119 * UI_SUBCELLS;
+        int bar, i, frame;
+        for (bar = 0; bar < n; bar++) {
+                scale[bar] = bar ? BENCH_TICKS : BENCH_TICKS * (n - 1);
+                for (i = 0; i < NSTATS; i++)
+                        cumm[i * n + bar] = bench_rand() % (scale[bar] + 1);
+        }
+
+        uint64_t start = bench_nsec(), sum = 0;
+        for (frame = 0; frame < frames; frame++) {
+                for (bar = 0; !scalar && bar < n; bar++) {
+                        uint64_t recip = ui_recip(total, scale[bar]);
+                        rint[bar] = recip >> 32;
+                        rfrac[bar] = recip;
+                }
+                for (i = 0; i < NSTATS; i++) {
+                        if (scalar)
+                                ui_scale_cutoffs_scalar(&out[i * n],
+                                                        &cumm[i * n], scale,
+                                                        total, n);
+                        else
+                                ui_scale_cutoffs(&out[i * n], &cumm[i * n],
+                                                 scale, rint, rfrac, total,
+                                                 n);
+                }
+                sum += out[frame % n];
+        }
+        double ns = (double)(bench_nsec() - start) / frames;
+        bench_cutoffs_sum = sum;
+        free(cumm);
+        free(out);
+        free(scale);
+        free(rint);
+        free(rfrac);
+        return ns;
+}
+
+// Check ui_scale_cutoffs against the division it replaced, for bar
+// lengths up to 1000 rows and scales of every width up to 32 bits.
+// The values include the ones either side of each scale's cutoffs,
+// where a reciprocal that's off by one shows.  Then time the two for
+// each CPU count in cpus.
+static void
+bench_cutoffs(const int *cpus, int ncpus, int frames)
+{
+        static const int lengths[] = {1, 7, 40, 119, 1000};
+        enum { N = 256 };
+        uint32_t cumm[N], scale[N], rint[N], rfrac[N], vec[N], div[N];
+        unsigned long long checked = 0;
+        int l, bits, round, i;
+        for (l = 0; l < (int)(sizeof lengths / sizeof lengths[0]); l++) {
+                uint32_t total = lengths[l] * UI_SUBCELLS;
+                for (bits = 0; bits <= 32; bits++) {
+                        for (round = 0; round < 64; round++) {
+                                uint64_t lo = bits ? 1ull << (bits - 1) : 0;
+                                uint64_t s = lo + (bits > 1 ?
+                                                   bench_rand() % lo : 0);
+                                if (round == 1)
+                                        s = lo ? 2 * lo - 1 : 0;
+                                for (i = 0; i < N; i++) {
+                                        uint64_t k = bench_rand() % (total + 1);
+                                        uint64_t c = (k * s + total - 1) / total;
+                                        if (i % 4 == 1)
+                                                c -= c > 0;
+                                        else if (i % 4 == 2)
+                                                c = s ? bench_rand() % (s + 1) : 0;
+                                        else if (i % 4 == 3)
+                                                c = i & 4 ? s : 0;
+                                        cumm[i] = MIN(c, s);
+                                        scale[i] = s;
+                                        uint64_t recip = ui_recip(total, s);
+                                        rint[i] = recip >> 32;
+                                        rfrac[i] = recip;
+                                }
+                                ui_scale_cutoffs(vec, cumm, scale, rint,
+                                                 rfrac, total, N);
+                                ui_scale_cutoffs_scalar(div, cumm, scale,
+                                                        total, N);
+                                for (i = 0; i < N; i++)
+                                        if (vec[i] != div[i])
+                                                panic("%u * %u / %u is %u, "
+                                                      "not %u", cumm[i],
+                                                      total, scale[i],
+                                                      div[i], vec[i]);
+                                checked += N;
+                        }
+                }
+        }
+        printf("%llu cutoffs agree with division; "
+               "times in ns/frame\n", checked);
+
+        printf("%5s %10s %10s %8s\n", "cpus", "reciprocal", "division",
+               "speedup");
+        for (i = 0; i < ncpus; i++) {
+                double recip_ns = bench_cutoffs_one(cpus[i] + 1, false,
+                                                    frames);
+                double div_ns = bench_cutoffs_one(cpus[i] + 1, true, frames);
+                printf("%5d %10.0f %10.0f %7.1fx\n", cpus[i], recip_ns,
+                       div_ns, div_ns / recip_ns);
+        }
+}
+
+// Parse the /proc/stat recorded in path with both cpustats_parse_stat
+// and the sscanf parser, check that they agree, and print how long
+// each took.
+static void
+bench_parse(const char *path, int frames)
+{
+        FILE *fp = fopen(path, "r");
+        if (!fp)
+                epanic("failed to open %s", path);
+        static char stat[1 << 20];
+        size_t len = fread(stat, 1, sizeof stat - 1, fp);
+        if (ferror(fp) || !feof(fp))
+                panic("%s: read failed or file too large", path);
+        fclose(fp);
+        stat[len] = 0;
+
+        // Size the stats to the highest CPU it has
+        const char *pos;
+        int cpus = 1;
+        for (pos = stat; (pos = strstr(pos, "\ncpu")); pos++)
+                if (isdigit(pos[4]))
+                        cpus = MAX(cpus, atoi(pos + 4) + 1);
+        cpustats_cpus = cpus;
+        cpustats_words = (cpus + 63) / 64;
 
-                SWAP(before, after);
-                SWAP(delta, prevLayout);
+        struct cpustats *a = cpustats_alloc(), *b = cpustats_alloc();
+        double parser_ns = bench_parse_one(cpustats_parse_stat, a, stat,
+                                           frames);
+        double sscanf_ns = bench_parse_one(bench_sscanf_stat, b, stat,
+                                           frames);
+        int field;
+        bool same = cpustats_sets_equal(a, b);
+        for (field = 0; same && field < NFIELDS; field++)
+                same = !memcmp(a->field[field] - 1, b->field[field] - 1,
+                               (cpus + 1) * sizeof *a->field[field]);
+        if (!same)
+                panic("%s: the parsers disagree", path);
+
+        printf("%s: %d cpus, %zu bytes; %d parses, times in ns/parse\n",
+               path, cpus, len, frames);
+        printf("%10s %10s %8s\n", "parser", "sscanf", "speedup");
+        printf("%10.0f %10.0f %7.1fx\n", parser_ns, sscanf_ns,
+               sscanf_ns / parser_ns);
+}
+
+int
+main(int argc, char **argv)
+{
+        bool force_ascii = false;
+        int frames = 200, rows = 120, cols = 320, busy = 0;
+        const char *parse_path = NULL;
+        bool check = false;
+
+        int opt;
+        while ((opt = getopt(argc, argv, "acf:k:p:s:")) != -1) {
+                switch (opt) {
+                case 'a':
+                        force_ascii = true;
+                        break;
+                case 'c':
+                        check = true;
+                        break;
+                case 'f':
+                        frames = atoi(optarg);
+                        if (frames > 0)
+                                break;
+                        fprintf(stderr, "Frames argument (-f) requires "
+                                "a positive number\n");
+                        exit(2);
+                case 'k':
+                        busy = atoi(optarg);
+                        if (busy > 0)
+                                break;
+                        fprintf(stderr, "Busy argument (-k) requires "
+                                "a positive number\n");
+                        exit(2);
+                case 'p':
+                        parse_path = optarg;
+                        break;
+                case 's':
+                        if (sscanf(optarg, "%dx%d", &rows, &cols) == 2 &&
+                            rows > 0 && cols > 0)
+                                break;
+                        fprintf(stderr, "Size argument (-s) must be "
+                                "ROWSxCOLS\n");
+                        exit(2);
+                default:
+                        fprintf(stderr, "Usage: %s [-a] [-f frames] [-k busy] "
+                                "[-s ROWSxCOLS] [cpus...]\n"
+                                "       %s [-f frames] -p stat\n"
+                                "       %s [-f frames] -c [cpus...]\n",
+                                argv[0], argv[0], argv[0]);
+                        exit(2);
+                }
+        }
+        if (parse_path) {
+                bench_parse(parse_path, frames);
+                return 0;
+        }
+
+        static const int default_cpus[] = {8, 64, 512, 4096};
+        int n = argc - optind, i;
+        if (!n)
+                n = sizeof default_cpus / sizeof default_cpus[0];
+        int *cpus = malloc(n * sizeof *cpus);
+        if (!cpus)
+                epanic("allocating CPU counts");
+        for (i = 0; i < n; i++) {
+                cpus[i] = optind < argc ? atoi(argv[optind + i]) :
+                        default_cpus[i];
+                if (cpus[i] <= 0)
+                        panic("bad CPU count %s", argv[optind + i]);
+        }
+        if (check) {
+                bench_cutoffs(cpus, n, frames * 100);
+                return 0;
         }
 
+        printf("%d frames on a %dx%d %s terminal", frames, rows, cols,
+               force_ascii ? "ASCII" : "Unicode");
+        if (busy)
+                printf(", busiest %d", busy);
+#ifdef CPUBARS_SCALAR
+        printf(", scalar cutoffs");
+#endif
+        printf("; times in ns/frame, sizes in bytes/frame\n");
+        printf("%5s %10s %8s %8s %10s %8s %10s %8s\n", "cpus", "read",
+               "in", "delta", "compute", "show", "out", "total");
+        for (i = 0; i < n; i++) {
+                int ncpus = cpus[i];
+                // Each size runs in its own process, since the stat
+                // and UI state is all global
+                fflush(stdout);
+                pid_t pid = fork();
+                if (pid < 0)
+                        epanic("fork");
+                if (pid == 0) {
+                        bench_run(ncpus, frames, rows, cols, force_ascii, busy);
+                        exit(0);
+                }
+                int status;
+                if (waitpid(pid, &status, 0) < 0)
+                        epanic("waitpid");
+                if (!WIFEXITED(status) || WEXITSTATUS(status))
+                        panic("benchmark of %d CPU's failed", ncpus);
+        }
         return 0;
 }
+#endif // CPUBARS_BENCH